@@ -13,6 +13,14 @@
 #define BUF_SIZE 4096
 #define MAX_FILE_SIZE (10*1024*1024)
 
+// Command output arrives as frames starting with a NUL and a type byte; the exit
+// frame (status as decimal text) ends it. Notices (broadcasts) may come at any time
+// and are not a reply. Any other message is a one-shot reply.
+#define FRAME_STDOUT 'O'
+#define FRAME_STDERR 'E'
+#define FRAME_EXIT   'X'
+#define FRAME_NOTICE 'N'
+
 int send_all(int sock, const void *buf, int len) {
     int total = 0;
     const char *p = (const char *)buf;
@@ -59,6 +67,45 @@ void trim_end(char *s) {
         s[i--] = '\0';
 }
 
+// Like recv_message(), but prints any notices that come first.
+int recv_response(int sock, char *buf, int max_len) {
+    while (1) {
+        int r = recv_message(sock, buf, max_len);
+        if (r < 2 || buf[0] != '\0' || buf[1] != FRAME_NOTICE) return r;
+        fwrite(buf + 2, 1, r - 2, stdout);
+    }
+}
+
+// Prints the reply to one command, following streamed output until its exit frame. A
+// text frame that arrives once output has started is printed inline: only the exit
+// frame ends a stream.
+int recv_reply(int sock, char *buf, int max_len) {
+    int streaming = 0;
+    while (1) {
+        int r = recv_response(sock, buf, max_len);
+        if (r < 0) return -1;
+        if (r < 2 || buf[0] != '\0') {
+            printf("%s", buf);
+            if (!streaming) return 0;
+            continue;
+        }
+        streaming = 1;
+        if (buf[1] == FRAME_STDOUT) {
+            fwrite(buf + 2, 1, r - 2, stdout);
+        } else if (buf[1] == FRAME_STDERR) {
+            fflush(stdout);
+            fwrite(buf + 2, 1, r - 2, stderr);
+        } else if (buf[1] == FRAME_EXIT) {
+            int status = atoi(buf + 2);
+            if (status != 0) {
+                fflush(stdout);
+                fprintf(stderr, "[exit status %d]\n", status);
+            }
+            return 0;
+        }
+    }
+}
+
 int handle_upload_cmd(int sockfd, char *input) {
     char *tok = strtok(input, " ");
     tok = strtok(NULL, " ");
@@ -127,7 +174,7 @@ int handle_upload_cmd(int sockfd, char *input) {
     free(buf);
 
     char resp[BUF_SIZE];
-    int r = recv_message(sockfd, resp, sizeof(resp));
+    int r = recv_response(sockfd, resp, sizeof(resp));
     if (r <= 0) {
         printf("Failed to receive upload response.\n");
         return -1;
@@ -164,7 +211,7 @@ int handle_download_cmd(int sockfd, char *input) {
     }
 
     char resp[BUF_SIZE];
-    int r = recv_message(sockfd, resp, sizeof(resp));
+    int r = recv_response(sockfd, resp, sizeof(resp));
     if (r <= 0) {
         printf("Connection lost.\n");
         return -1;
@@ -229,7 +276,7 @@ int main(int argc, char *argv[]) {
 
     int sockfd;
     struct sockaddr_in server_addr;
-    char buf[BUF_SIZE];
+    char buf[BUF_SIZE * 4];
 
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("socket");
@@ -357,17 +404,16 @@ int main(int argc, char *argv[]) {
         }
 
         if (strcmp(input, "exit") == 0) {
-            int r = recv_message(sockfd, buf, sizeof(buf));
+            int r = recv_response(sockfd, buf, sizeof(buf));
             if (r > 0) printf("%s", buf);
             break;
         }
 
-        int r = recv_message(sockfd, buf, sizeof(buf));
-        if (r <= 0) {
+        if (recv_reply(sockfd, buf, sizeof(buf)) == -1) {
             printf("Connection lost.\n");
             break;
         }
-        printf("%s", buf);
+        fflush(stdout);
     }
 
     close(sockfd);
@@ -6,22 +6,75 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <time.h>
 #include <limits.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <spawn.h>
+
+// Build with -DUSE_SELECT for the portable select() loop; the default is epoll.
+#ifdef USE_SELECT
+#include <sys/select.h>
+#define MAX_CLIENTS FD_SETSIZE
+#else
+#include <sys/epoll.h>
+#define MAX_CLIENTS 4096
+#endif
 
 #define PORT 12345
 #define BACKLOG 10
 #define BUF_SIZE 4096
-#define MAX_CLIENTS FD_SETSIZE
+#define MAX_EVENTS 64
 #define MAX_FILE_SIZE (10*1024*1024)
 
+#define IN_BUF_SIZE  (BUF_SIZE + 4)     // one whole frame: length prefix + payload
+#define OUT_CHUNK    (64*1024)          // download bytes read from disk per refill
+#define OUT_HIGH     (256*1024)         // stop parsing requests above this backlog
+#define OUT_MAX      (4*1024*1024)      // drop a peer whose backlog grows past this
+#define READ_BUDGET  (256*1024)         // bytes read per client before yielding
+#define MSG_PATH_MAX (BUF_SIZE - 128)   // longest path quoted in a reply, room left for strerror()
+
 #define CMD_WINDOW_SECONDS 5
 #define CMD_WINDOW_MAX     10
 
+#define MAX_JOBS            32      // shell commands running at once, server-wide
+#define MAX_JOBS_PER_USER   4       // ... and per user name, across sessions
+#define CMD_TIMEOUT_SECONDS 30
+#define JOB_READ_BUDGET     (64*1024)
+
+// Command output is streamed as frames whose payload starts with a NUL (never the
+// first byte of a text reply) and a type: stdout/stderr data, then one exit frame
+// carrying the status as decimal text, which also ends the stream. Broadcasts go out
+// as notice frames, so a client never mistakes one for the reply it is waiting for.
+#define FRAME_STDOUT 'O'
+#define FRAME_STDERR 'E'
+#define FRAME_EXIT   'X'
+#define FRAME_NOTICE 'N'
+#define FRAME_DATA_MAX (BUF_SIZE - 3)   // payload stays below the peer's BUF_SIZE limit
+
+// What an fd registered with the reactor belongs to. Each registered struct starts
+// with its kind, so the event loop can tell them apart from the pointer alone.
+typedef enum {
+    SRC_LISTENER,
+    SRC_CLIENT,
+    SRC_JOB,
+} SourceKind;
+
 typedef struct {
+    char  *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+struct Job;
+
+typedef struct Client {
+    SourceKind kind;
     int fd;
     int in_use;
     int auth_stage;
@@ -36,8 +89,67 @@ typedef struct {
     // Rate limiting
     time_t window_start;
     int    window_count;
+
+    // Sockets are non-blocking: requests are parsed out of in_buf as bytes
+    // arrive, and replies queue in out until the socket takes them.
+    char   in_buf[IN_BUF_SIZE];
+    size_t in_len;
+    OutBuf out;
+    OutBuf held;            // replies queued while a download body is in flight
+    int    want_write;
+    int    input_paused;
+    int    dropped;
+
+    // UPLOAD body still to come; upload_fp is NULL when it is being discarded
+    FILE  *upload_fp;
+    long   upload_left;
+    long   upload_size;
+    char   upload_name[PATH_MAX];
+    const char *upload_err;
+
+    // DOWNLOAD body still to send, read from disk one chunk at a time
+    FILE  *download_fp;
+    long   download_left;
+    long   download_size;
+
+    // Shell command in flight; requests wait until its reply has been queued
+    struct Job *job;
+
+    // Clients with work left over after their budget ran out
+    int    scheduled;
+    struct Client *ready_next;
+
+    // Free slots are chained through next; authenticated clients form a
+    // doubly linked list (in login order) through next/prev.
+    struct Client *next;
+    struct Client *prev;
 } Client;
 
+// One output pipe of a job, registered with the reactor as an SRC_JOB source.
+typedef struct {
+    SourceKind kind;
+    struct Job *job;
+    int fd;                 // read end, -1 after EOF
+    char frame_type;        // FRAME_STDOUT or FRAME_STDERR
+} JobPipe;
+
+// A shell command spawned for a client; its stdout and stderr pipes are watched by
+// the reactor and forwarded as they fill.
+typedef struct Job {
+    int in_use;
+    pid_t pid;              // also the process group, so a timeout kills the pipeline
+    JobPipe pipes[2];
+    int paused;             // pipes left out of the reactor while the client catches up
+    int exited;
+    int status;
+    int timed_out;
+    time_t deadline;
+    Client *owner;          // NULL once the client has gone
+    char username[32];
+    char cmd[BUF_SIZE];
+    long bytes_out;
+} Job;
+
 typedef struct {
     const char *user;
     const char *pass;
@@ -51,89 +163,205 @@ Cred credentials[] = {
 const int NUM_CREDS = sizeof(credentials) / sizeof(credentials[0]);
 
 Client clients[MAX_CLIENTS];
+Client *free_clients = NULL;
+Client *auth_head = NULL, *auth_tail = NULL;
+int auth_count = 0;
 int listen_fd;
 FILE *log_fp = NULL;
 int total_commands_executed = 0;
+Client *ready_head = NULL, *ready_tail = NULL;
+Job jobs[MAX_JOBS];
+int active_jobs = 0;
+SourceKind listener_source = SRC_LISTENER;
+extern char **environ;
+
+/* ------------ Reactor: readiness events for registered fds ------------ */
+// Every fd is registered with a pointer that comes back with its events; it points at
+// a struct starting with a SourceKind (a Client, a Job, or listener_source). Sockets
+// are edge-triggered under epoll, so a handler must read everything that is buffered
+// before it returns (or put the client on the ready list to carry on later). Command
+// pipes are level-triggered and read a bounded amount per wakeup.
+#define READY_IN  1
+#define READY_OUT 2
 
-/* ------------ Network: send/recv raw ------------ */
-int send_all(int sock, const void *buf, int len) {
-    int total = 0;
-    const char *p = (const char *)buf;
-    while (total < len) {
-        int n = send(sock, p + total, len - total, 0);
-        if (n <= 0) return -1;
-        total += n;
-    }
+typedef struct {
+    void *ptr;
+    int events;
+} ReadyEvent;
+
+#ifndef USE_SELECT
+int epoll_fd = -1;
+
+int reactor_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd == -1 ? -1 : 0;
+}
+
+int reactor_add(int fd, void *ptr) {
+    struct epoll_event ev;
+    ev.events = *(SourceKind *)ptr == SRC_JOB ? EPOLLIN : EPOLLIN | EPOLLET;
+    ev.data.ptr = ptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Turns EPOLLOUT on while a client has queued output, off once it drains.
+int reactor_mod(int fd, void *ptr, int want_write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int reactor_del(int fd) {
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Edge-triggered sockets report nothing more until they are drained, so a client whose
+// in_buf is full needs no masking here.
+int reactor_read(int fd, int want_read) {
+    (void)fd;
+    (void)want_read;
     return 0;
 }
 
-int recv_all(int sock, void *buf, int len) {
-    int total = 0;
-    char *p = (char *)buf;
-    while (total < len) {
-        int n = recv(sock, p + total, len - total, 0);
-        if (n <= 0) return -1;
-        total += n;
+// Waits up to timeout_ms (-1 = forever); returns the number of events stored in out.
+int reactor_wait(ReadyEvent *out, int max, int timeout_ms) {
+    struct epoll_event evs[MAX_EVENTS];
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+    int n = epoll_wait(epoll_fd, evs, max, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        out[i].ptr = evs[i].data.ptr;
+        out[i].events = 0;
+        // errors and hangups surface through the next recv()
+        if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) out[i].events |= READY_IN;
+        if (evs[i].events & EPOLLOUT) out[i].events |= READY_OUT;
     }
+    return n;
+}
+#else
+fd_set master_set;
+fd_set write_set;
+int max_fd = -1;
+void *fd_ptrs[FD_SETSIZE];
+
+int reactor_init() {
+    FD_ZERO(&master_set);
+    FD_ZERO(&write_set);
     return 0;
 }
 
-/* ------------ Network: send/recv message (length + payload) ------------ */
-int send_message(int sock, const char *msg) {
-    uint32_t len = (uint32_t)strlen(msg);
-    uint32_t net_len = htonl(len);
-    if (send_all(sock, &net_len, sizeof(net_len)) == -1) return -1;
-    if (len > 0 && send_all(sock, msg, len) == -1) return -1;
+int reactor_add(int fd, void *ptr) {
+    if (fd >= FD_SETSIZE) return -1;
+    FD_SET(fd, &master_set);
+    fd_ptrs[fd] = ptr;
+    if (fd > max_fd) max_fd = fd;
     return 0;
 }
 
-int recv_message(int sock, char *buf, int max_len) {
-    uint32_t net_len;
-    if (recv_all(sock, &net_len, sizeof(net_len)) == -1) return -1;
-    uint32_t len = ntohl(net_len);
-    if (len >= (uint32_t)max_len) {
-        // message quá dài
-        return -1;
+int reactor_mod(int fd, void *ptr, int want_write) {
+    if (fd < 0 || fd >= FD_SETSIZE) return -1;
+    (void)ptr;
+    if (want_write) FD_SET(fd, &write_set);
+    else FD_CLR(fd, &write_set);
+    return 0;
+}
+
+int reactor_del(int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE) return -1;
+    FD_CLR(fd, &master_set);
+    FD_CLR(fd, &write_set);
+    fd_ptrs[fd] = NULL;
+    return 0;
+}
+
+// select() is level-triggered: a socket left in the read set while its client's in_buf
+// is full would be reported readable on every pass.
+int reactor_read(int fd, int want_read) {
+    if (fd < 0 || fd >= FD_SETSIZE) return -1;
+    if (want_read) FD_SET(fd, &master_set);
+    else FD_CLR(fd, &master_set);
+    return 0;
+}
+
+int reactor_wait(ReadyEvent *out, int max, int timeout_ms) {
+    fd_set read_fds = master_set;
+    fd_set write_fds = write_set;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    if (select(max_fd + 1, &read_fds, &write_fds, NULL,
+               timeout_ms < 0 ? NULL : &tv) == -1) return -1;
+    int n = 0;
+    for (int fd = 0; fd <= max_fd && n < max; fd++) {
+        int events = (FD_ISSET(fd, &read_fds) ? READY_IN : 0) |
+                     (FD_ISSET(fd, &write_fds) ? READY_OUT : 0);
+        if (events) {
+            out[n].ptr = fd_ptrs[fd];
+            out[n].events = events;
+            n++;
+        }
     }
-    if (len > 0 && recv_all(sock, buf, len) == -1) return -1;
-    buf[len] = '\0';
-    return (int)len;
+    return n;
 }
+#endif
 
 /* ------------ Clients management ------------ */
+// clients[] is a slab: free slots sit on a free list, so taking and returning
+// one is O(1) however many clients are connected.
 void init_clients() {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    free_clients = NULL;
+    for (int i = MAX_CLIENTS - 1; i >= 0; i--) {
+        clients[i].kind = SRC_CLIENT;
         clients[i].fd = -1;
         clients[i].in_use = 0;
+        clients[i].next = free_clients;
+        free_clients = &clients[i];
     }
 }
 
 Client* add_client(int fd, struct sockaddr_in *addr) {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (!clients[i].in_use) {
-            clients[i].fd = fd;
-            clients[i].in_use = 1;
-            clients[i].auth_stage = 0;
-            clients[i].auth_fail = 0;
-            clients[i].username[0] = '\0';
-            clients[i].role[0] = '\0';
-            inet_ntop(AF_INET, &addr->sin_addr, clients[i].addr_str,
-                      sizeof(clients[i].addr_str));
-            clients[i].port = ntohs(addr->sin_port);
-            clients[i].cmd_count = 0;
-
-            if (!getcwd(clients[i].cwd, sizeof(clients[i].cwd))) {
-                strcpy(clients[i].cwd, "/");
-            }
+    Client *c = free_clients;
+    if (!c) return NULL;
+    free_clients = c->next;
+
+    c->fd = fd;
+    c->in_use = 1;
+    c->auth_stage = 0;
+    c->auth_fail = 0;
+    c->username[0] = '\0';
+    c->role[0] = '\0';
+    inet_ntop(AF_INET, &addr->sin_addr, c->addr_str, sizeof(c->addr_str));
+    c->port = ntohs(addr->sin_port);
+    c->cmd_count = 0;
+    c->next = c->prev = NULL;
+    c->in_len = 0;
+    c->want_write = 0;
+    c->input_paused = 0;
+    c->dropped = 0;
+    c->upload_fp = NULL;
+    c->upload_left = 0;
+    c->download_fp = NULL;
+    c->download_left = 0;
+    c->job = NULL;
+
+    if (!getcwd(c->cwd, sizeof(c->cwd))) {
+        strcpy(c->cwd, "/");
+    }
 
-            // init rate limiting
-            clients[i].window_start = time(NULL);
-            clients[i].window_count = 0;
+    // init rate limiting
+    c->window_start = time(NULL);
+    c->window_count = 0;
 
-            return &clients[i];
-        }
-    }
-    return NULL;
+    return c;
+}
+
+// Marks c as logged in and appends it to the list who/stats/broadcast walk.
+void authenticate_client(Client *c) {
+    c->auth_stage = 2;
+    c->prev = auth_tail;
+    c->next = NULL;
+    if (auth_tail) auth_tail->next = c;
+    else auth_head = c;
+    auth_tail = c;
+    auth_count++;
 }
 
 void remove_client(Client *c) {
@@ -143,9 +371,238 @@ void remove_client(Client *c) {
            c->username[0] ? c->username : "UNKNOWN",
            c->addr_str,
            c->port);
+    reactor_del(c->fd);
+    if (c->out.off < c->out.len && !c->download_fp && !c->dropped) {
+        // best effort for a last reply such as "Bye."
+        send(c->fd, c->out.data + c->out.off, c->out.len - c->out.off, MSG_NOSIGNAL);
+    }
     close(c->fd);
+    if (c->upload_fp) {
+        // never leave a half-written upload behind
+        fclose(c->upload_fp);
+        if (chdir(c->cwd) == 0) unlink(c->upload_name);
+        c->upload_fp = NULL;
+    }
+    if (c->download_fp) {
+        fclose(c->download_fp);
+        c->download_fp = NULL;
+    }
+    if (c->job) {
+        // nobody is left to read the result; the job is reaped as usual
+        Job *j = c->job;
+        j->owner = NULL;
+        // once reaped, the pid (and so the group id) may belong to someone else
+        if (!j->exited) kill(-j->pid, SIGKILL);
+        if (j->paused) {
+            // drain the pipes to EOF so the job can finish
+            j->paused = 0;
+            for (int k = 0; k < 2; k++) {
+                if (j->pipes[k].fd != -1) reactor_add(j->pipes[k].fd, &j->pipes[k]);
+            }
+        }
+        c->job = NULL;
+    }
+    free(c->out.data);
+    free(c->held.data);
+    memset(&c->out, 0, sizeof(c->out));
+    memset(&c->held, 0, sizeof(c->held));
+    if (c->auth_stage == 2) {
+        if (c->prev) c->prev->next = c->next;
+        else auth_head = c->next;
+        if (c->next) c->next->prev = c->prev;
+        else auth_tail = c->prev;
+        auth_count--;
+    }
     c->fd = -1;
     c->in_use = 0;
+    c->auth_stage = 0;
+    c->next = free_clients;
+    free_clients = c;
+}
+
+/* ------------ Utility: logging ------------ */
+void log_event(const char *username, const char *role, const char *addr, int port,
+               const char *cwd, const char *cmd, int bytes_out) {
+    if (!log_fp) return;
+    time_t now = time(NULL);
+    char tbuf[64];
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(log_fp, "[%s] user=%s role=%s ip=%s:%d cwd=\"%s\" cmd=\"%s\" bytes_out=%d\n",
+            tbuf,
+            username ? username : "UNKNOWN",
+            role ? role : "?",
+            addr ? addr : "?",
+            port,
+            cwd ? cwd : "?",
+            cmd ? cmd : "?",
+            bytes_out);
+    fflush(log_fp);
+}
+
+/* ------------ Network: per-connection output ------------ */
+// A client whose handler must run again without a new readiness edge (read budget
+// spent, output drained after a pause, or dropped) waits here for the main loop.
+void schedule_client(Client *c) {
+    if (c->scheduled) return;
+    c->scheduled = 1;
+    c->ready_next = NULL;
+    if (ready_tail) ready_tail->ready_next = c;
+    else ready_head = c;
+    ready_tail = c;
+}
+
+// Peers are not removed on the spot: the caller may be walking the client list
+// (broadcast) or still using the client. Shut the socket and let the loop reap it.
+void drop_client(Client *c) {
+    if (c->dropped) return;
+    c->dropped = 1;
+    shutdown(c->fd, SHUT_RDWR);
+    schedule_client(c);
+}
+
+size_t pending(const OutBuf *b) {
+    return b->len - b->off;
+}
+
+int outbuf_append(OutBuf *b, const void *data, size_t n) {
+    if (b->off == b->len) b->off = b->len = 0;
+    if (b->len + n > b->cap) {
+        if (b->off > 0) {
+            memmove(b->data, b->data + b->off, b->len - b->off);
+            b->len -= b->off;
+            b->off = 0;
+        }
+        if (b->len + n > b->cap) {
+            size_t cap = b->cap ? b->cap : BUF_SIZE;
+            while (cap < b->len + n) cap *= 2;
+            char *p = (char *)realloc(b->data, cap);
+            if (!p) return -1;
+            b->data = p;
+            b->cap = cap;
+        }
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+// Requests are not parsed while a command or a download is in flight or the peer is
+// not reading its replies, so replies keep request order and a slow reader throttles
+// itself and nobody else.
+int input_stalled(Client *c) {
+    return c->job != NULL || c->download_fp != NULL || pending(&c->out) > OUT_HIGH;
+}
+
+// Moves the next chunk of the file being downloaded into c->out.
+int refill_download(Client *c) {
+    if (c->out.cap < OUT_CHUNK) {
+        char *p = (char *)realloc(c->out.data, OUT_CHUNK);
+        if (!p) return -1;
+        c->out.data = p;
+        c->out.cap = OUT_CHUNK;
+    }
+    size_t want = c->download_left < OUT_CHUNK ? (size_t)c->download_left : OUT_CHUNK;
+    size_t n = fread(c->out.data, 1, want, c->download_fp);
+    if (n == 0) return -1;
+    c->out.off = 0;
+    c->out.len = n;
+    c->download_left -= (long)n;
+    if (c->download_left == 0) {
+        fclose(c->download_fp);
+        c->download_fp = NULL;
+        log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "DOWNLOAD",
+                  (int)c->download_size);
+        total_commands_executed++;
+        c->cmd_count++;
+        // replies held back during the transfer go out right after its last byte
+        if (pending(&c->held) > 0) {
+            if (outbuf_append(&c->out, c->held.data + c->held.off, pending(&c->held)) == -1)
+                return -1;
+            c->held.off = c->held.len = 0;
+        }
+    }
+    return 0;
+}
+
+// Writes as much queued output as the socket takes without blocking.
+int flush_output(Client *c) {
+    if (!c->in_use || c->dropped) return -1;
+    while (1) {
+        if (pending(&c->out) == 0) {
+            c->out.off = c->out.len = 0;
+            if (!c->download_fp) break;
+            if (refill_download(c) == -1) {
+                drop_client(c);
+                return -1;
+            }
+            continue;
+        }
+        ssize_t n = send(c->fd, c->out.data + c->out.off, pending(&c->out), MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out.off += (size_t)n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            drop_client(c);
+            return -1;
+        }
+    }
+
+    int want_write = pending(&c->out) > 0;
+    if (want_write != c->want_write) {
+        reactor_mod(c->fd, c, want_write);
+        c->want_write = want_write;
+    }
+    if (c->input_paused && !input_stalled(c)) {
+        c->input_paused = 0;
+        reactor_read(c->fd, 1);
+        schedule_client(c);
+    }
+    if (c->job && c->job->paused && pending(&c->out) <= OUT_HIGH) {
+        // the client has caught up: let its command's output flow again
+        c->job->paused = 0;
+        for (int k = 0; k < 2; k++) {
+            JobPipe *jp = &c->job->pipes[k];
+            if (jp->fd != -1) reactor_add(jp->fd, jp);
+        }
+    }
+    return 0;
+}
+
+/* ------------ Network: send message (length + payload) ------------ */
+// Queues one frame and pushes what it can; never blocks on a slow peer.
+int send_frame(Client *c, const void *msg, uint32_t len) {
+    if (!c->in_use || c->dropped) return -1;
+    uint32_t net_len = htonl(len);
+    OutBuf *b = c->download_fp ? &c->held : &c->out;
+    if (pending(&c->out) + pending(&c->held) + sizeof(net_len) + len > OUT_MAX) {
+        printf("Dropping fd=%d (%s@%s:%d): output backlog\n",
+               c->fd, c->username[0] ? c->username : "UNKNOWN", c->addr_str, c->port);
+        drop_client(c);
+        return -1;
+    }
+    if (outbuf_append(b, &net_len, sizeof(net_len)) == -1 ||
+        outbuf_append(b, msg, len) == -1) {
+        drop_client(c);
+        return -1;
+    }
+    return flush_output(c);
+}
+
+int send_message(Client *c, const char *msg) {
+    return send_frame(c, msg, (uint32_t)strlen(msg));
+}
+
+// Sends one tagged stream frame: NUL, type, then len bytes of data.
+int send_stream_frame(Client *c, char type, const char *data, size_t len) {
+    char frame[2 + FRAME_DATA_MAX];
+    if (len > FRAME_DATA_MAX) len = FRAME_DATA_MAX;
+    frame[0] = '\0';
+    frame[1] = type;
+    memcpy(frame + 2, data, len);
+    return send_frame(c, frame, (uint32_t)(2 + len));
 }
 
 /* ------------ Authentication check and Security ------------ */
@@ -193,7 +650,7 @@ int is_rate_limited(Client *c) {
                  "Please wait ~%d seconds...\n",
                  CMD_WINDOW_MAX, CMD_WINDOW_SECONDS, wait);
 
-        send_message(c->fd, msg);
+        send_message(c, msg);
         return 1;  // bị limit
     }
 
@@ -205,25 +662,21 @@ int is_rate_limited(Client *c) {
 void build_who(char *out, size_t out_sz) {
     out[0] = '\0';
     strcat(out, "Connected clients:\n");
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].in_use && clients[i].auth_stage == 2) {
-            char line[256];
-            snprintf(line, sizeof(line), "  %s (role=%s) @ %s:%d, cmds=%d\n",
-                     clients[i].username,
-                     clients[i].role,
-                     clients[i].addr_str,
-                     clients[i].port,
-                     clients[i].cmd_count);
-            strncat(out, line, out_sz - strlen(out) - 1);
-        }
+    size_t used = strlen(out);
+    for (Client *c = auth_head; c && used < out_sz - 1; c = c->next) {
+        int n = snprintf(out + used, out_sz - used, "  %s (role=%s) @ %s:%d, cmds=%d\n",
+                         c->username,
+                         c->role,
+                         c->addr_str,
+                         c->port,
+                         c->cmd_count);
+        if (n < 0) break;
+        used += (size_t)n;
     }
 }
 
 void build_stats(char *out, size_t out_sz) {
-    int active = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].in_use && clients[i].auth_stage == 2) active++;
-    }
+    int active = auth_count;
     snprintf(out, out_sz,
              "Server stats:\n"
              "  Active clients: %d\n"
@@ -238,132 +691,296 @@ void trim_end(char *s) {
         s[i--] = '\0';
 }
 
-/* ------------ Utility: logging ------------ */
-void log_event(const char *username, const char *role, const char *addr, int port,
-               const char *cwd, const char *cmd, int bytes_out) {
-    if (!log_fp) return;
-    time_t now = time(NULL);
-    char tbuf[64];
-    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(log_fp, "[%s] user=%s role=%s ip=%s:%d cwd=\"%s\" cmd=\"%s\" bytes_out=%d\n",
-            tbuf,
-            username ? username : "UNKNOWN",
-            role ? role : "?",
-            addr ? addr : "?",
-            port,
-            cwd ? cwd : "?",
-            cmd ? cmd : "?",
-            bytes_out);
-    fflush(log_fp);
+/* ------------ Logic: Command execution ------------ */
+// Commands run as "/bin/sh -c cmd" in their own process group. The reactor reads the
+// stdout and stderr pipes as they fill and streams each read to the client at once;
+// the exit frame follows when both pipes are at EOF and the shell has been reaped.
+// A slow command only holds up the client that ran it, and a client that does not
+// read its output pauses the pipes, so the command blocks instead of memory growing.
+int count_user_jobs(const char *username) {
+    int n = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].in_use && jobs[i].owner && strcmp(jobs[i].username, username) == 0)
+            n++;
+    }
+    return n;
 }
 
-/* ------------ Logic: Command execution ------------ */
-int execute_command(const char *cmd, char *out_buf, int max_len) {
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        snprintf(out_buf, max_len, "Failed to run command: %s\n", strerror(errno));
-        return (int)strlen(out_buf);
+Job* start_job(Client *c, const char *cmd) {
+    Job *j = NULL;
+    for (int i = 0; i < MAX_JOBS && !j; i++) {
+        if (!jobs[i].in_use) j = &jobs[i];
+    }
+    if (!j) return NULL;
+
+    int out[2], err[2];
+    if (pipe(out) == -1) return NULL;
+    if (pipe(err) == -1) {
+        close(out[0]);
+        close(out[1]);
+        return NULL;
     }
-    int total = 0;
-    while (!feof(fp) && total < max_len - 1) {
-        int n = fread(out_buf + total, 1, max_len - 1 - total, fp);
-        if (n <= 0) break;
-        total += n;
+    int fds[] = { out[0], out[1], err[0], err[1] };
+    for (int k = 0; k < 4; k++) fcntl(fds[k], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+    fcntl(err[0], F_SETFL, fcntl(err[0], F_GETFL) | O_NONBLOCK);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+    pid_t pid;
+    int rc = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(out[1]);
+    close(err[1]);
+    if (rc != 0) {
+        close(out[0]);
+        close(err[0]);
+        errno = rc;
+        return NULL;
     }
-    out_buf[total] = '\0';
-    pclose(fp);
-    return total;
+
+    j->in_use = 1;
+    j->pid = pid;
+    j->paused = 0;
+    j->exited = 0;
+    j->status = 0;
+    j->timed_out = 0;
+    j->deadline = time(NULL) + CMD_TIMEOUT_SECONDS;
+    j->owner = c;
+    strncpy(j->username, c->username, sizeof(j->username));
+    j->username[sizeof(j->username) - 1] = '\0';
+    strncpy(j->cmd, cmd, sizeof(j->cmd));
+    j->cmd[sizeof(j->cmd) - 1] = '\0';
+    j->bytes_out = 0;
+    for (int k = 0; k < 2; k++) {
+        JobPipe *jp = &j->pipes[k];
+        jp->kind = SRC_JOB;
+        jp->job = j;
+        jp->fd = k == 0 ? out[0] : err[0];
+        jp->frame_type = k == 0 ? FRAME_STDOUT : FRAME_STDERR;
+        if (reactor_add(jp->fd, jp) == -1) {
+            // still runs to completion; only this stream is lost
+            close(jp->fd);
+            jp->fd = -1;
+        }
+    }
+    active_jobs++;
+    c->job = j;
+    return j;
 }
 
-/* ------------ Logic: File transfer helpers ------------ */
-int handle_upload_data(Client *c, const char *remote_path, long size) {
-    if (size < 0 || size > MAX_FILE_SIZE) {
-        send_message(c->fd, "UPLOAD_ERROR: invalid size.\n");
-        return -1;
+int job_output_done(Job *j) {
+    return j->pipes[0].fd == -1 && j->pipes[1].fd == -1;
+}
+
+// Sends the exit frame for a finished job and frees its slot.
+void finish_job(Job *j) {
+    Client *c = j->owner;
+    j->in_use = 0;
+    active_jobs--;
+    if (!c) return;
+    c->job = NULL;
+
+    if (j->timed_out) {
+        char note[128];
+        snprintf(note, sizeof(note),
+                 "Command timed out after %d seconds.\n", CMD_TIMEOUT_SECONDS);
+        send_stream_frame(c, FRAME_STDERR, note, strlen(note));
     }
-    char *buf = (char *)malloc(size);
-    if (!buf) {
-        send_message(c->fd, "UPLOAD_ERROR: malloc failed.\n");
-        return -1;
+    // shell convention: 128 + signal number for a killed command
+    int code = WIFEXITED(j->status) ? WEXITSTATUS(j->status)
+             : WIFSIGNALED(j->status) ? 128 + WTERMSIG(j->status) : 1;
+    char status[16];
+    snprintf(status, sizeof(status), "%d", code);
+    send_stream_frame(c, FRAME_EXIT, status, strlen(status));
+    log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
+              j->cmd, (int)j->bytes_out);
+    total_commands_executed++;
+    c->cmd_count++;
+}
+
+// Forwards what the pipe holds, one frame per read. Stops early, taking the pipes out
+// of the reactor, once the client has more than OUT_HIGH bytes waiting.
+void handle_job_output(JobPipe *jp) {
+    Job *j = jp->job;
+    char data[FRAME_DATA_MAX];
+    size_t budget = JOB_READ_BUDGET;
+    while (budget > 0) {
+        ssize_t n = read(jp->fd, data, sizeof(data));
+        if (n > 0) {
+            j->bytes_out += n;
+            budget = (size_t)n < budget ? budget - (size_t)n : 0;
+            Client *c = j->owner;
+            if (!c) continue;
+            send_stream_frame(c, jp->frame_type, data, (size_t)n);
+            if (pending(&c->out) > OUT_HIGH) {
+                j->paused = 1;
+                for (int k = 0; k < 2; k++) {
+                    if (j->pipes[k].fd != -1) reactor_del(j->pipes[k].fd);
+                }
+                return;
+            }
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            // EOF (or a broken pipe): the command is done writing here
+            reactor_del(jp->fd);
+            close(jp->fd);
+            jp->fd = -1;
+            break;
+        }
     }
-    if (chdir(c->cwd) == -1) {
-        free(buf);
-        send_message(c->fd, "UPLOAD_ERROR: chdir failed.\n");
-        return -1;
+    if (job_output_done(j) && j->exited) finish_job(j);
+}
+
+// Reaps exited commands with WNOHANG and kills the ones past their deadline.
+void check_jobs() {
+    if (active_jobs == 0) return;
+    time_t now = time(NULL);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        Job *j = &jobs[i];
+        if (!j->in_use) continue;
+        if (!j->exited && waitpid(j->pid, &j->status, WNOHANG) == j->pid) {
+            j->exited = 1;
+        }
+        if (!j->timed_out && now >= j->deadline) {
+            // the whole group, so background children cannot keep the pipes open
+            j->timed_out = 1;
+            if (!j->exited) kill(-j->pid, SIGKILL);
+            if (j->paused) {
+                // its client stopped reading: drop the unread output rather than hold
+                // the slot until the client catches up or goes away
+                for (int k = 0; k < 2; k++) {
+                    if (j->pipes[k].fd != -1) close(j->pipes[k].fd);
+                    j->pipes[k].fd = -1;
+                }
+                j->paused = 0;
+            }
+        }
+        if (j->exited && job_output_done(j)) finish_job(j);
     }
-    if (recv_all(c->fd, buf, (int)size) == -1) {
-        free(buf);
-        send_message(c->fd, "UPLOAD_ERROR: connection lost while receiving file.\n");
-        return -1;
+}
+
+// How long the reactor may sleep before check_jobs() has something to do.
+int jobs_timeout_ms() {
+    if (active_jobs == 0) return -1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        // output done but not yet reaped: the exit is a moment away
+        if (jobs[i].in_use && job_output_done(&jobs[i]) && !jobs[i].exited) return 10;
     }
-    FILE *f = fopen(remote_path, "wb");
-    if (!f) {
-        free(buf);
-        send_message(c->fd, "UPLOAD_ERROR: cannot open remote file.\n");
-        return -1;
+    return 1000;
+}
+
+/* ------------ Logic: File transfer helpers ------------ */
+// The client sends the body right after a well-formed header, so it is consumed even
+// when the upload is refused; otherwise its bytes would be parsed as requests.
+int parse_upload_header(const char *cmd, char *remote, long *size) {
+    if (strncmp(cmd, "UPLOAD ", 7) != 0) return 0;
+    if (sscanf(cmd + 7, "%s %ld", remote, size) != 2) return 0;
+    return *size >= 0 && *size <= MAX_FILE_SIZE;
+}
+
+void finish_upload(Client *c) {
+    if (c->upload_fp) {
+        int failed = fclose(c->upload_fp) != 0;
+        c->upload_fp = NULL;
+        if (!failed) {
+            // room for the longest name, the fixed text and a 64-bit size
+            char msg[sizeof(c->upload_name) + 64];
+            snprintf(msg, sizeof(msg),
+                     "UPLOAD_OK: wrote %ld bytes to %s\n", c->upload_size, c->upload_name);
+            send_message(c, msg);
+            log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "UPLOAD",
+                      (int)c->upload_size);
+            total_commands_executed++;
+            c->cmd_count++;
+            return;
+        }
+        if (chdir(c->cwd) == 0) unlink(c->upload_name);
+        c->upload_err = "UPLOAD_ERROR: write error.\n";
     }
-    size_t written = fwrite(buf, 1, size, f);
-    fclose(f);
-    free(buf);
-    if (written != (size_t)size) {
-        send_message(c->fd, "UPLOAD_ERROR: write error.\n");
-        return -1;
+    if (c->upload_err) send_message(c, c->upload_err);
+}
+
+// Sets up c to take the next size bytes of input as the file body. With discard
+// set they are thrown away and no reply follows (one has been sent already).
+void start_upload(Client *c, const char *remote_path, long size, int discard) {
+    strncpy(c->upload_name, remote_path, sizeof(c->upload_name));
+    c->upload_name[sizeof(c->upload_name) - 1] = '\0';
+    c->upload_size = size;
+    c->upload_left = size;
+    c->upload_fp = NULL;
+    c->upload_err = NULL;
+    if (!discard) {
+        if (chdir(c->cwd) == -1) {
+            c->upload_err = "UPLOAD_ERROR: chdir failed.\n";
+        } else if (!(c->upload_fp = fopen(remote_path, "wb"))) {
+            c->upload_err = "UPLOAD_ERROR: cannot open remote file.\n";
+        }
     }
-    char msg[256];
-    snprintf(msg, sizeof(msg),
-             "UPLOAD_OK: wrote %ld bytes to %s\n", size, remote_path);
-    send_message(c->fd, msg);
-    log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "UPLOAD", (int)size);
-    total_commands_executed++;
-    c->cmd_count++;
-    return 0;
+    if (size == 0) finish_upload(c);
 }
 
+// Writes a piece of the upload body straight to disk as it arrives.
+void upload_data(Client *c, const char *data, size_t n) {
+    if (c->upload_fp && fwrite(data, 1, n, c->upload_fp) != n) {
+        fclose(c->upload_fp);
+        c->upload_fp = NULL;
+        if (chdir(c->cwd) == 0) unlink(c->upload_name);
+        c->upload_err = "UPLOAD_ERROR: write error.\n";
+    }
+    c->upload_left -= (long)n;
+    if (c->upload_left == 0) finish_upload(c);
+}
+
+// Replies with the header; flush_output() then streams the body from disk.
 int handle_download_data(Client *c, const char *remote_path) {
     if (chdir(c->cwd) == -1) {
-        send_message(c->fd, "DOWNLOAD_ERR: chdir failed.\n");
+        send_message(c, "DOWNLOAD_ERR: chdir failed.\n");
         return -1;
     }
     FILE *f = fopen(remote_path, "rb");
     if (!f) {
-        send_message(c->fd, "DOWNLOAD_ERR: cannot open file.\n");
+        send_message(c, "DOWNLOAD_ERR: cannot open file.\n");
         return -1;
     }
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    if (size < 0 || size > MAX_FILE_SIZE) {
+    struct stat st;
+    if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size > MAX_FILE_SIZE) {
         fclose(f);
-        send_message(c->fd, "DOWNLOAD_ERR: invalid file size.\n");
-        return -1;
-    }
-    char *buf = (char *)malloc(size);
-    if (!buf) {
-        fclose(f);
-        send_message(c->fd, "DOWNLOAD_ERR: malloc failed.\n");
-        return -1;
-    }
-    size_t rd = fread(buf, 1, size, f);
-    fclose(f);
-    if (rd != (size_t)size) {
-        free(buf);
-        send_message(c->fd, "DOWNLOAD_ERR: read error.\n");
+        send_message(c, "DOWNLOAD_ERR: invalid file size.\n");
         return -1;
     }
+    long size = (long)st.st_size;
     char header[128];
     snprintf(header, sizeof(header), "DOWNLOAD_OK %ld", size);
-    if (send_message(c->fd, header) == -1) {
-        free(buf);
+    if (send_message(c, header) == -1) {
+        fclose(f);
         return -1;
     }
-    if (send_all(c->fd, buf, (int)size) == -1) {
-        free(buf);
-        return -1;
+    if (size == 0) {
+        fclose(f);
+        log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "DOWNLOAD", 0);
+        total_commands_executed++;
+        c->cmd_count++;
+        return 0;
     }
-    free(buf);
-    log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "DOWNLOAD", (int)size);
-    total_commands_executed++;
-    c->cmd_count++;
+    c->download_fp = f;
+    c->download_left = size;
+    c->download_size = size;
+    flush_output(c);
     return 0;
 }
 
@@ -375,19 +992,22 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     trim_end(cmd);
 
     if (strlen(cmd) == 0) {
-        send_message(c->fd, "");
+        send_message(c, "");
         return;
     }
 
     // Rate limit check
     if (is_rate_limited(c)) {
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "RATE_LIMIT", 0);
+        char remote[PATH_MAX];
+        long size;
+        if (parse_upload_header(cmd, remote, &size)) start_upload(c, remote, size, 1);
         return;
     }
 
     // exit
     if (strcmp(cmd, "exit") == 0) {
-        send_message(c->fd, "Bye.\n");
+        send_message(c, "Bye.\n");
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "exit", 4);
         remove_client(c);
         return;
@@ -406,7 +1026,7 @@ void handle_shell_command(Client *c, const char *cmd_in) {
             "  download <remote> <local>  - client-side, gets file from server\n"
             "  exit                       - disconnect\n"
             "Other text is executed as shell command on server.\n";
-        send_message(c->fd, help_msg);
+        send_message(c, help_msg);
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "help",
                   (int)strlen(help_msg));
         return;
@@ -416,7 +1036,7 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     if (strcmp(cmd, "who") == 0) {
         char out[BUF_SIZE * 2];
         build_who(out, sizeof(out));
-        send_message(c->fd, out);
+        send_message(c, out);
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "who",
                   (int)strlen(out));
         return;
@@ -425,12 +1045,12 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     // stats (admin only)
     if (strcmp(cmd, "stats") == 0) {
         if (strcmp(c->role, "admin") != 0) {
-            send_message(c->fd, "Permission denied: admin only.\n");
+            send_message(c, "Permission denied: admin only.\n");
             return;
         }
         char out[BUF_SIZE];
         build_stats(out, sizeof(out));
-        send_message(c->fd, out);
+        send_message(c, out);
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "stats",
                   (int)strlen(out));
         return;
@@ -439,17 +1059,17 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     // broadcast (admin only)
     if (strncmp(cmd, "broadcast ", 10) == 0) {
         if (strcmp(c->role, "admin") != 0) {
-            send_message(c->fd, "Permission denied: admin only.\n");
+            send_message(c, "Permission denied: admin only.\n");
             return;
         }
         const char *msg = cmd + 10;
         char full[BUF_SIZE];
-        snprintf(full, sizeof(full), "[BROADCAST from %s]: %s\n", c->username, msg);
+        // a long message is cut short, never the newline
+        snprintf(full, sizeof(full), "[BROADCAST from %s]: %.*s\n",
+                 c->username, (int)(BUF_SIZE - sizeof(c->username) - 32), msg);
 
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].in_use && clients[i].auth_stage == 2) {
-                send_message(clients[i].fd, full);
-            }
+        for (Client *other = auth_head; other; other = other->next) {
+            send_stream_frame(other, FRAME_NOTICE, full, strlen(full));
         }
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
                   "broadcast", (int)strlen(full));
@@ -463,10 +1083,14 @@ void handle_shell_command(Client *c, const char *cmd_in) {
         char remote[PATH_MAX];
         long size;
         if (sscanf(cmd + 7, "%s %ld", remote, &size) != 2) {
-            send_message(c->fd, "UPLOAD_ERROR: invalid header.\n");
+            send_message(c, "UPLOAD_ERROR: invalid header.\n");
+            return;
+        }
+        if (size < 0 || size > MAX_FILE_SIZE) {
+            send_message(c, "UPLOAD_ERROR: invalid size.\n");
             return;
         }
-        handle_upload_data(c, remote, size);
+        start_upload(c, remote, size, 0);
         return;
     }
 
@@ -474,7 +1098,7 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     if (strncmp(cmd, "DOWNLOAD ", 9) == 0) {
         char remote[PATH_MAX];
         if (sscanf(cmd + 9, "%s", remote) != 1) {
-            send_message(c->fd, "DOWNLOAD_ERR: invalid header.\n");
+            send_message(c, "DOWNLOAD_ERR: invalid header.\n");
             return;
         }
         handle_download_data(c, remote);
@@ -487,8 +1111,8 @@ void handle_shell_command(Client *c, const char *cmd_in) {
         if (chdir(path) == -1) {
             char msg[BUF_SIZE];
             snprintf(msg, sizeof(msg),
-                     "cd: %s: %s\n", path, strerror(errno));
-            send_message(c->fd, msg);
+                     "cd: %.*s: %s\n", MSG_PATH_MAX, path, strerror(errno));
+            send_message(c, msg);
             log_event(c->username, c->role, c->addr_str, c->port, c->cwd, cmd,
                       (int)strlen(msg));
             chdir(c->cwd);
@@ -499,7 +1123,7 @@ void handle_shell_command(Client *c, const char *cmd_in) {
         }
         char msg[BUF_SIZE];
         snprintf(msg, sizeof(msg), "Current directory: %s\n", c->cwd);
-        send_message(c->fd, msg);
+        send_message(c, msg);
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd, cmd,
                   (int)strlen(msg));
         return;
@@ -507,7 +1131,7 @@ void handle_shell_command(Client *c, const char *cmd_in) {
 
     //shell
     if (strcmp(c->role, "admin") != 0 && is_dangerous_for_user(cmd)) {
-        send_message(c->fd, "Permission denied: dangerous command blocked for this user.\n");
+        send_message(c, "Permission denied: dangerous command blocked for this user.\n");
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
                   "BLOCKED_CMD", 0);
         return;
@@ -516,29 +1140,206 @@ void handle_shell_command(Client *c, const char *cmd_in) {
     if (chdir(c->cwd) == -1) {
         char out[BUF_SIZE];
         snprintf(out, sizeof(out),
-                 "Failed to chdir to %s: %s\n", c->cwd, strerror(errno));
-        send_message(c->fd, out);
+                 "Failed to chdir to %.*s: %s\n", MSG_PATH_MAX, c->cwd, strerror(errno));
+        send_message(c, out);
         log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
                   cmd, (int)strlen(out));
         return;
     }
 
-    char out_buf[BUF_SIZE * 4];
-    int out_len = execute_command(cmd, out_buf, sizeof(out_buf));
-    send_message(c->fd, out_buf);
-    log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
-              cmd, out_len);
-    total_commands_executed++;
-    c->cmd_count++;
+    if (active_jobs >= MAX_JOBS || count_user_jobs(c->username) >= MAX_JOBS_PER_USER) {
+        char out[BUF_SIZE];
+        snprintf(out, sizeof(out),
+                 "Server busy: at most %d commands per user and %d in total may run "
+                 "at once. Try again later.\n", MAX_JOBS_PER_USER, MAX_JOBS);
+        send_message(c, out);
+        log_event(c->username, c->role, c->addr_str, c->port, c->cwd, "BUSY", 0);
+        return;
+    }
+    if (!start_job(c, cmd)) {
+        char out[BUF_SIZE];
+        snprintf(out, sizeof(out), "Failed to run command: %s\n", strerror(errno));
+        send_message(c, out);
+        log_event(c->username, c->role, c->addr_str, c->port, c->cwd,
+                  cmd, (int)strlen(out));
+    }
+}
+
+/* ------------ Controller: login, then shell commands ------------ */
+void handle_message(Client *c, char *buf) {
+    if (c->auth_stage == 0) {
+        // username
+        strncpy(c->username, buf, sizeof(c->username));
+        c->username[sizeof(c->username) - 1] = '\0';
+        c->auth_stage = 1;
+        send_message(c, "Enter password: ");
+    } else if (c->auth_stage == 1) {
+        // password
+        char password[64];
+        strncpy(password, buf, sizeof(password));
+        password[sizeof(password) - 1] = '\0';
+
+        const char *role = get_role_for_credentials(c->username, password);
+        if (role) {
+            strncpy(c->role, role, sizeof(c->role));
+            c->role[sizeof(c->role) - 1] = '\0';
+            authenticate_client(c);
+
+            char welcome[256];
+            snprintf(welcome, sizeof(welcome),
+                     "Authentication successful. Welcome %s (role=%s).\n"
+                     "Type 'help' for commands.\n",
+                     c->username, c->role);
+            send_message(c, welcome);
+            log_event(c->username, c->role, c->addr_str, c->port,
+                      c->cwd, "LOGIN", (int)strlen(welcome));
+        } else {
+            c->auth_fail++;
+            if (c->auth_fail >= 3) {
+                send_message(c,
+                             "Authentication failed too many times. Bye.\n");
+                log_event(c->username, c->role, c->addr_str, c->port,
+                          c->cwd, "AUTH_FAIL", 0);
+                remove_client(c);
+            } else {
+                send_message(c,
+                             "Invalid credentials. Try again.\nEnter username: ");
+                c->auth_stage = 0;
+            }
+        }
+    } else {
+        // shell phase
+        handle_shell_command(c, buf);
+    }
+}
+
+// Parses every complete frame in c->in_buf; a pending upload takes raw bytes first.
+void process_input(Client *c) {
+    size_t pos = 0;
+    while (c->in_use && !c->dropped) {
+        size_t avail = c->in_len - pos;
+        if (c->upload_left > 0) {
+            if (avail == 0) break;
+            size_t take = avail < (size_t)c->upload_left ? avail : (size_t)c->upload_left;
+            upload_data(c, c->in_buf + pos, take);
+            pos += take;
+            continue;
+        }
+        if (input_stalled(c)) {
+            c->input_paused = 1;
+            break;
+        }
+        uint32_t net_len;
+        if (avail < sizeof(net_len)) break;
+        memcpy(&net_len, c->in_buf + pos, sizeof(net_len));
+        uint32_t len = ntohl(net_len);
+        if (len >= BUF_SIZE) {
+            // message quá dài
+            remove_client(c);
+            return;
+        }
+        if (avail < sizeof(net_len) + len) break;
+        char buf[BUF_SIZE];
+        memcpy(buf, c->in_buf + pos + sizeof(net_len), len);
+        buf[len] = '\0';
+        pos += sizeof(net_len) + len;
+        handle_message(c, buf);
+    }
+    if (c->in_use && pos > 0) {
+        memmove(c->in_buf, c->in_buf + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+}
+
+// One edge can stand for several queued messages, so keep reading until the socket
+// is drained. A client that has used up its READ_BUDGET goes on the ready list and
+// continues after everyone else has had a turn. While its requests are paused it is
+// still read until in_buf fills up, so a hangup is noticed (and its command killed)
+// straight away.
+void handle_client_input(Client *c) {
+    if (!c->in_use) return;
+    if (c->dropped) {
+        remove_client(c);
+        return;
+    }
+    process_input(c);
+    size_t budget = READ_BUDGET;
+    while (c->in_use && !c->dropped && c->in_len < sizeof(c->in_buf)) {
+        if (budget == 0) {
+            schedule_client(c);
+            return;
+        }
+        ssize_t n = recv(c->fd, c->in_buf + c->in_len, sizeof(c->in_buf) - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            budget = (size_t)n < budget ? budget - (size_t)n : 0;
+            process_input(c);
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            // disconnected
+            remove_client(c);
+            return;
+        }
+    }
+    if (c->in_use && c->dropped) remove_client(c);
+    // in_buf is full of paused requests: stop listening until flush_output resumes them
+    else if (c->in_use) reactor_read(c->fd, 0);
+}
+
+// Handles the clients queued by schedule_client(); new ones may be queued meanwhile
+// and wait for the next round.
+void run_ready_clients() {
+    Client *c = ready_head;
+    ready_head = ready_tail = NULL;
+    while (c) {
+        Client *next = c->ready_next;
+        c->scheduled = 0;
+        handle_client_input(c);
+        c = next;
+    }
+}
+
+// The listening socket is non-blocking: accept until the backlog is empty.
+void accept_clients() {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+        if (new_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if (fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+            fcntl(new_fd, F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+            close(new_fd);
+            continue;
+        }
+        Client *c = add_client(new_fd, &client_addr);
+        if (!c) {
+            printf("Too many clients, rejecting.\n");
+            close(new_fd);
+            continue;
+        }
+        if (reactor_add(new_fd, c) == -1) {
+            perror("reactor_add");
+            remove_client(c);
+            continue;
+        }
+
+        printf("New connection fd=%d from %s:%d\n", new_fd, c->addr_str, c->port);
+
+        send_message(c, "Enter username: ");
+    }
 }
 
 /* ------------ Main ------------ */
 int main() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len;
-    fd_set read_fds, master_set;
-    int max_fd;
-    char buf[BUF_SIZE];
+    struct sockaddr_in server_addr;
 
     log_fp = fopen("server.log", "a");
     if (!log_fp) {
@@ -575,120 +1376,48 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("Remote shell server MAX listening on port %d...\n", PORT);
+    if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+        fcntl(listen_fd, F_SETFD, FD_CLOEXEC) == -1 ||
+        reactor_init() == -1 || reactor_add(listen_fd, &listener_source) == -1) {
+        perror("reactor");
+        exit(EXIT_FAILURE);
+    }
 
-    FD_ZERO(&master_set);
-    FD_SET(listen_fd, &master_set);
-    max_fd = listen_fd;
+    printf("Remote shell server MAX listening on port %d...\n", PORT);
 
+    ReadyEvent events[MAX_EVENTS];
     while (1) {
-        read_fds = master_set;
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) == -1) {
-            perror("select");
+        int n = reactor_wait(events, MAX_EVENTS, ready_head ? 0 : jobs_timeout_ms());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("reactor_wait");
             exit(EXIT_FAILURE);
         }
 
-        for (int fd = 0; fd <= max_fd; fd++) {
-            if (!FD_ISSET(fd, &read_fds)) continue;
-
-            if (fd == listen_fd) {
+        for (int i = 0; i < n; i++) {
+            switch (*(SourceKind *)events[i].ptr) {
+            case SRC_LISTENER:
                 // new connection
-                addr_len = sizeof(client_addr);
-                int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
-                if (new_fd == -1) {
-                    perror("accept");
-                    continue;
-                }
-                if (!c) {
-                    printf("Too many clients, rejecting.\n");
-                    close(new_fd);
-                    continue;
-                }
-
-                FD_SET(new_fd, &master_set);
-                if (new_fd > max_fd) max_fd = new_fd;
-
-                printf("New connection fd=%d from %s:%d\n", new_fd, c->addr_str, c->port);
-
-                send_message(new_fd, "Enter username: ");
-            } else {
+                accept_clients();
+                break;
+            case SRC_CLIENT: {
                 // existing client
-                Client *c = NULL;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (clients[i].in_use && clients[i].fd == fd) {
-                        c = &clients[i];
-                        break;
-                    }
-                }
-                if (!c) {
-                    close(fd);
-                    FD_CLR(fd, &master_set);
-                    continue;
-                }
-
-                int len = recv_message(fd, buf, sizeof(buf));
-                if (len <= 0) {
-                    // disconnected
-                    remove_client(c);
-                    FD_CLR(fd, &master_set);
-                    continue;
-                }
-
-                if (c->auth_stage < 2) {
-                    if (c->auth_stage == 0) {
-                        // username
-                        strncpy(c->username, buf, sizeof(c->username));
-                        c->username[sizeof(c->username) - 1] = '\0';
-                        c->auth_stage = 1;
-                        send_message(fd, "Enter password: ");
-                    } else if (c->auth_stage == 1) {
-                        // password
-                        char password[64];
-                        strncpy(password, buf, sizeof(password));
-                        password[sizeof(password) - 1] = '\0';
-
-                        const char *role = get_role_for_credentials(c->username, password);
-                        if (role) {
-                            strncpy(c->role, role, sizeof(c->role));
-                            c->role[sizeof(c->role) - 1] = '\0';
-                            c->auth_stage = 2;
-
-                            char welcome[256];
-                            snprintf(welcome, sizeof(welcome),
-                                     "Authentication successful. Welcome %s (role=%s).\n"
-                                     "Type 'help' for commands.\n",
-                                     c->username, c->role);
-                            send_message(fd, welcome);
-                            log_event(c->username, c->role, c->addr_str, c->port,
-                                      c->cwd, "LOGIN", (int)strlen(welcome));
-                        } else {
-                            c->auth_fail++;
-                            if (c->auth_fail >= 3) {
-                                send_message(fd,
-                                             "Authentication failed too many times. Bye.\n");
-                                log_event(c->username, c->role, c->addr_str, c->port,
-                                          c->cwd, "AUTH_FAIL", 0);
-                                FD_CLR(fd, &master_set);
-                                remove_client(c);
-                            } else {
-                                send_message(fd,
-                                             "Invalid credentials. Try again.\nEnter username: ");
-                                c->auth_stage = 0;
-                            }
-                        }
-                    }
-                } else {
-                    // shell phase
-                    handle_shell_command(c, buf);
-                    if (!c->in_use) {
-                        FD_CLR(fd, &master_set);
-                    }
-                }
+                Client *c = (Client *)events[i].ptr;
+                if (events[i].events & READY_OUT) flush_output(c);
+                if (events[i].events & READY_IN) handle_client_input(c);
+                break;
+            }
+            case SRC_JOB:
+                // stdout or stderr of a running command
+                handle_job_output((JobPipe *)events[i].ptr);
+                break;
             }
         }
+        check_jobs();
+        run_ready_clients();
     }
 
     if (log_fp) fclose(log_fp);
     close(listen_fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,90 +1,1566 @@
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
 #include <thread>
-#include <sstream>
+#include <cstdint>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <charconv>
+#include <memory>
+#include <queue>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <climits>
+#include <cstdio>
+#include "../mapreduce/mapreduce.h"
+#include "../mapreduce/net.h"
+#include "../mapreduce/dict_format.h"
+#include "../mapreduce/alloc_count.h"
 
 using namespace std;
+using mapreduce::JobStats;
+using mapreduce::MapReduce;
+using mapreduce::parse_number;
+using mapreduce::parse_size;
+
+const size_t MAX_MERGE_FANIN = 64;
+const size_t DEFAULT_APPROX_TOP = 100;
 
-const int NUM_THREADS = 4;
+struct Options {
+    mapreduce::Config engine;  // -j, --block-size
+    vector<string> inputs;     // files, directories or glob patterns
+    const char* filename = nullptr;    // the input, once expanded to a single file
+    bool stream = false;
+    size_t mem_budget = 256 << 20;
+    string spill_dir = ".";
+    size_t top_k = 0;          // 0 writes every word
+    uint64_t min_count = 1;
+    bool approx = false;
+    double eps = 1e-4;         // Count-Min error, relative to the total number of words
+    double delta = 0.01;       // probability of exceeding that error
+    int hll_precision = 14;
+    string stats_json;         // empty: human-readable report only
+    string checkpoint_dir;     // --checkpoint: persist finished splits, resume from them
+    size_t checkpoint_every = 16;  // splits per thread between checkpoints
+    bool incremental = false;  // --incremental: only count what was appended since the last run
+    string worker_addr;        // --worker: serve map tasks instead of running a job
+    string worker_root = ".";  // --root: the only tree a worker reads files from
+    vector<string> workers;    // --workers: run the map phase on these workers
+};
 
-string clean_word(const string& w) {
-    string res = "";
+//HASH TABLE: open addressing with linear probing, one per (mapper, partition) and per reducer
+uint64_t hash_word(string_view w) {
+    uint64_t h = 14695981039346656037ULL;
     for (char c : w) {
-        if (isalnum(c)) res += tolower(c);
+        h ^= (unsigned char)c;
+        h *= 1099511628211ULL;
     }
-    return res;
+    return h;
 }
 
-//MAPPER
-void map_function(const string& text_chunk, map<string, int>& local_result) {
-    stringstream ss(text_chunk);
-    string word;
-    while (ss >> word) {
-        string cleaned = clean_word(word);
-        if (!cleaned.empty()) local_result[cleaned]++;
+// Low hash bits pick the slot, high bits pick the partition, so both stay well spread.
+inline size_t partition_of(uint64_t hash, size_t num_partitions) {
+    return (hash >> 32) % num_partitions;
+}
+
+//ARENA: bump allocator that interns word bytes. Table keys are string_views into an
+// arena and stay valid until it is reset or destroyed, so reducer tables can point at
+// the mapper keys directly instead of copying them.
+class Arena {
+public:
+    string_view intern(string_view s) {
+        if (s.size() > left) {
+            size_t size = max(BLOCK_SIZE, s.size());
+            blocks.emplace_back(new char[size]);
+            cur = blocks.back().get();
+            left = size;
+            reserved += size;
+        }
+        memcpy(cur, s.data(), s.size());
+        string_view out(cur, s.size());
+        cur += s.size();
+        left -= s.size();
+        return out;
+    }
+
+    size_t bytes() const { return reserved; }
+
+    void reset() {
+        blocks.clear();
+        cur = nullptr;
+        left = reserved = 0;
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+    vector<unique_ptr<char[]>> blocks;
+    char* cur = nullptr;
+    size_t left = 0, reserved = 0;
+};
+
+class WordTable {
+public:
+    struct Slot {
+        uint64_t hash = 0;
+        uint64_t count = 0;    // 0 marks an empty slot
+        string_view key;
+    };
+
+    WordTable() : slots(16) {}
+
+    // Adds n occurrences of word; a word seen for the first time is copied into arena.
+    void add(string_view word, uint64_t hash, uint64_t n, Arena& arena) {
+        bool inserted;
+        Slot& s = slot_for(word, hash, inserted);
+        if (inserted) s.key = arena.intern(word);
+        s.count += n;
+    }
+
+    // Same, but keeps key itself, which must outlive the table (e.g. a mapper table key).
+    void add(string_view key, uint64_t hash, uint64_t n) {
+        bool inserted;
+        slot_for(key, hash, inserted).count += n;
+    }
+
+    // Overwrites the count of word (inserting it if needed) instead of adding to it.
+    void set(string_view word, uint64_t hash, uint64_t n, Arena& arena) {
+        bool inserted;
+        Slot& s = slot_for(word, hash, inserted);
+        if (inserted) s.key = arena.intern(word);
+        s.count = n;
     }
+
+    void set(string_view key, uint64_t hash, uint64_t n) {
+        bool inserted;
+        slot_for(key, hash, inserted).count = n;
+    }
+
+    size_t size() const { return used; }
+
+    // Slot array footprint; the key bytes are accounted for by the arena.
+    size_t memory_bytes() const { return slots.size() * sizeof(Slot); }
+
+    void clear() {
+        vector<Slot>(16).swap(slots);
+        used = 0;
+    }
+
+    template <class F>
+    void for_each(F f) const {
+        for (const Slot& s : slots) {
+            if (s.count) f(s);
+        }
+    }
+
+    // Lets f rewrite counts in place; keys must not change.
+    template <class F>
+    void for_each(F f) {
+        for (Slot& s : slots) {
+            if (s.count) f(s);
+        }
+    }
+
+private:
+    // Finds word, or claims the empty slot it belongs in (count still 0, key set to word).
+    Slot& slot_for(string_view word, uint64_t hash, bool& inserted) {
+        if ((used + 1) * 4 > slots.size() * 3) grow();
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].count && !(slots[i].hash == hash && slots[i].key == word)) i = (i + 1) & mask;
+        inserted = slots[i].count == 0;
+        if (inserted) {
+            slots[i].hash = hash;
+            slots[i].key = word;
+            used++;
+        }
+        return slots[i];
+    }
+
+    void grow() {
+        vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& s : old) {
+            if (!s.count) continue;
+            size_t i = s.hash & mask;
+            while (slots[i].count) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+
+    vector<Slot> slots;
+    size_t used = 0;
+};
+
+// One mapper's output: a table per partition plus the arena all their keys live in.
+struct MapperTables {
+    Arena arena;
+    vector<WordTable> partitions;
+    vector<size_t> pending_splits;     // --checkpoint: splits counted here, not yet saved
+
+    explicit MapperTables(size_t num_partitions) : partitions(num_partitions) {}
+
+    size_t memory_bytes() const {
+        size_t bytes = arena.bytes();
+        for (const auto& t : partitions) bytes += t.memory_bytes();
+        return bytes;
+    }
+
+    void clear() {
+        for (auto& t : partitions) t.clear();
+        arena.reset();
+        pending_splits.clear();
+    }
+};
+
+//TOKENIZER: words are runs of non-whitespace; inside a word [A-Za-z0-9] is kept
+// (lowercased) and every other byte (punctuation, UTF-8) is dropped.
+// Bytes are classified 64 at a time into bitmasks with SSE2/AVX2 when available.
+struct ByteClasses {
+    bool space[256];
+    char normalized[256];    // lowercase alnum, or 0 for bytes that are dropped
+
+    ByteClasses() {
+        for (int c = 0; c < 256; ++c) {
+            space[c] = (c == ' ' || (c >= '\t' && c <= '\r'));
+            normalized[c] = isalnum(c) ? (char)tolower(c) : 0;
+        }
+    }
+};
+const ByteClasses BYTE_CLASSES;
+
+// ws: bit i set if byte i is whitespace; dirty: bit i set if byte i is not [a-z0-9]
+// and so forces the word through the normalizer.
+inline void classify64(const char* p, uint64_t& ws, uint64_t& dirty) {
+#if defined(__AVX2__)
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    const __m256i lo_a = _mm256_set1_epi8('a'), n25 = _mm256_set1_epi8(25);
+    const __m256i lo_0 = _mm256_set1_epi8('0'), n9 = _mm256_set1_epi8(9);
+    ws = dirty = 0;
+    for (int k = 0; k < 2; ++k) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32 * k));
+        __m256i ctl = _mm256_sub_epi8(v, tab);
+        __m256i is_ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                        _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+        __m256i a = _mm256_sub_epi8(v, lo_a), d = _mm256_sub_epi8(v, lo_0);
+        __m256i clean = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(a, n25), a),
+                                        _mm256_cmpeq_epi8(_mm256_min_epu8(d, n9), d));
+        ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_ws) << (32 * k);
+        dirty |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(clean) << (32 * k);
+    }
+#elif defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    const __m128i lo_a = _mm_set1_epi8('a'), n25 = _mm_set1_epi8(25);
+    const __m128i lo_0 = _mm_set1_epi8('0'), n9 = _mm_set1_epi8(9);
+    ws = dirty = 0;
+    for (int k = 0; k < 4; ++k) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * k));
+        __m128i ctl = _mm_sub_epi8(v, tab);
+        __m128i is_ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                     _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+        __m128i a = _mm_sub_epi8(v, lo_a), d = _mm_sub_epi8(v, lo_0);
+        __m128i clean = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(a, n25), a),
+                                     _mm_cmpeq_epi8(_mm_min_epu8(d, n9), d));
+        ws |= (uint64_t)_mm_movemask_epi8(is_ws) << (16 * k);
+        dirty |= (uint64_t)(~_mm_movemask_epi8(clean) & 0xFFFF) << (16 * k);
+    }
+#else
+    ws = dirty = 0;
+    for (int k = 0; k < 64; ++k) {
+        unsigned char c = p[k];
+        ws |= (uint64_t)BYTE_CLASSES.space[c] << k;
+        dirty |= (uint64_t)(BYTE_CLASSES.normalized[c] != (char)c) << k;
+    }
+#endif
 }
 
-//REDUCER
-void reduce_function(const vector<map<string, int>>& all_maps, map<string, int>& final_result) {
-    for (const auto& local_map : all_maps) {
-        for (const auto& pair : local_map) {
-            final_result[pair.first] += pair.second;
+// Calls emit(string_view) for every non-empty normalized word in text. Words that are
+// already lowercase alnum are handed out as slices of text; only the others are
+// rewritten, into the caller's reused scratch buffer, so nothing is allocated per word.
+template <class Emit>
+void tokenize(string_view text, string& scratch, Emit emit) {
+    const char* p = text.data();
+    const size_t n = text.size();
+    bool in_word = false, word_dirty = false;
+    size_t word_start = 0;
+
+    auto finish_word = [&](size_t end) {
+        if (!word_dirty) {
+            emit(string_view(p + word_start, end - word_start));
+            return;
+        }
+        scratch.clear();
+        for (size_t i = word_start; i < end; ++i) {
+            char c = BYTE_CLASSES.normalized[(unsigned char)p[i]];
+            if (c) scratch.push_back(c);
+        }
+        if (!scratch.empty()) emit(string_view(scratch));
+    };
+
+    for (size_t base = 0; base < n; base += 64) {
+        uint64_t ws, dirty;
+        if (n - base >= 64) {
+            classify64(p + base, ws, dirty);
+        } else {
+            char tail[64];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p + base, n - base);
+            classify64(tail, ws, dirty);
+        }
+
+        unsigned pos = 0;
+        while (pos < 64) {
+            if (in_word) {
+                uint64_t rest = ws >> pos;
+                if (rest == 0) {
+                    word_dirty |= (dirty >> pos) != 0;
+                    break;
+                }
+                unsigned len = __builtin_ctzll(rest);
+                word_dirty |= ((dirty >> pos) & ((1ULL << len) - 1)) != 0;
+                pos += len;
+                if (base + pos >= n) break;    // padding after the end of text, not a real boundary
+                finish_word(base + pos);
+                in_word = false;
+            } else {
+                uint64_t rest = ~ws >> pos;
+                if (rest == 0) break;
+                pos += __builtin_ctzll(rest);
+                word_start = base + pos;
+                in_word = true;
+                word_dirty = false;
+            }
         }
     }
+    if (in_word) finish_word(n);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cout << "Usage: ./wordcount <filename>" << endl;
+//OUTPUT: "word<sep>count" lines through one large stdio buffer, no flush per line
+class LineWriter {
+public:
+    LineWriter(const string& path, string_view sep) : f(fopen(path.c_str(), "w")), sep(sep) {
+        if (f) setvbuf(f, nullptr, _IOFBF, 1 << 20);
+    }
+    ~LineWriter() { close(); }
+    bool ok() const { return f != nullptr; }
+
+    bool close() {
+        bool flushed = f && fclose(f) == 0;
+        f = nullptr;
+        return flushed;
+    }
+
+    void write(string_view key, uint64_t count) {
+        char num[24];
+        char* end = to_chars(num, num + sizeof(num), count).ptr;
+        *end++ = '\n';
+        fwrite(key.data(), 1, key.size(), f);
+        fwrite(sep.data(), 1, sep.size(), f);
+        fwrite(num, 1, end - num, f);
+    }
+
+private:
+    FILE* f;
+    string_view sep;
+};
+
+// Top-K order: higher count first, ties broken alphabetically so the output is stable.
+inline bool ranks_before(uint64_t count_a, string_view key_a, uint64_t count_b, string_view key_b) {
+    return count_a != count_b ? count_a > count_b : key_a < key_b;
+}
+
+// Entries of every table (WordTables, or anything with a .table member) sorted by word.
+inline const WordTable& table_of(const WordTable& t) { return t; }
+template <class T>
+const WordTable& table_of(const T& holder) { return holder.table; }
+
+template <class Tables>
+vector<const WordTable::Slot*> sorted_entries(const Tables& tables, uint64_t min_count) {
+    vector<const WordTable::Slot*> sorted;
+    for (const auto& table : tables) {
+        table_of(table).for_each([&](const WordTable::Slot& s) {
+            if (s.count >= min_count) sorted.push_back(&s);
+        });
+    }
+    sort(sorted.begin(), sorted.end(),
+         [](const WordTable::Slot* a, const WordTable::Slot* b) { return a->key < b->key; });
+    return sorted;
+}
+
+// Keeps the k best-ranked entries of candidates (partial sort, not a full one).
+void keep_top(vector<const WordTable::Slot*>& candidates, size_t k) {
+    auto by_rank = [](const WordTable::Slot* a, const WordTable::Slot* b) {
+        return ranks_before(a->count, a->key, b->count, b->key);
+    };
+    k = min(k, candidates.size());
+    partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(), by_rank);
+    candidates.resize(k);
+}
+
+// Streaming counterpart of keep_top: a bounded heap whose top is the worst entry kept so far.
+class TopK {
+public:
+    explicit TopK(size_t k) : k(k) {}
+
+    void add(string_view key, uint64_t count) {
+        if (heap.size() == k) {
+            const auto& worst = heap.front();
+            if (!ranks_before(count, key, worst.second, worst.first)) return;
+            pop_heap(heap.begin(), heap.end(), by_rank);
+            heap.pop_back();
+        }
+        heap.emplace_back(string(key), count);
+        push_heap(heap.begin(), heap.end(), by_rank);
+    }
+
+    vector<pair<string, uint64_t>> sorted() {
+        sort_heap(heap.begin(), heap.end(), by_rank);
+        return heap;
+    }
+
+private:
+    static bool by_rank(const pair<string, uint64_t>& a, const pair<string, uint64_t>& b) {
+        return ranks_before(a.second, a.first, b.second, b.first);
+    }
+
+    size_t k;
+    vector<pair<string, uint64_t>> heap;
+};
+
+//SPILL: a run is a binary dictionary file (mapreduce/dict_format.h), sorted by word
+class SpillManager {
+public:
+    explicit SpillManager(const string& dir) : dir(dir) {}
+
+    ~SpillManager() {
+        for (const auto& path : runs) unlink(path.c_str());
+    }
+
+    string new_run_path() {
+        lock_guard<mutex> lock(m);
+        return dir + "/wordcount-spill-" + to_string(getpid()) + "-" + to_string(next_id++) + ".run";
+    }
+
+    // Writes the tables out as one sorted run and empties them.
+    bool spill(MapperTables& tables) {
+        string path = new_run_path();
+        mapreduce::DictWriter out(path.c_str());
+        if (!out.ok()) return false;
+        for (const auto* s : sorted_entries(tables.partitions, 1)) out.add(s->key, s->count);
+        if (!out.finish()) return false;
+        tables.clear();
+        add_run(path);
+        return true;
+    }
+
+    void add_run(const string& path) {
+        lock_guard<mutex> lock(m);
+        runs.push_back(path);
+    }
+
+    vector<string> runs;
+
+private:
+    string dir;
+    mutex m;
+    int next_id = 0;
+};
+
+//MERGE: k-way merge over sorted sources, summing the counts of equal words
+struct MergeSource {
+    string_view key;
+    uint64_t count = 0;
+    virtual bool next() = 0;
+    virtual bool failed() const { return false; }    // ended on an error, not at its end
+    virtual ~MergeSource() = default;
+};
+
+struct TableSource : MergeSource {
+    vector<const WordTable::Slot*> entries;
+    size_t pos = 0;
+
+    explicit TableSource(const MapperTables& tables) : entries(sorted_entries(tables.partitions, 1)) {}
+
+    bool next() override {
+        if (pos == entries.size()) return false;
+        key = entries[pos]->key;
+        count = entries[pos++]->count;
+        return true;
+    }
+};
+
+struct RunSource : MergeSource {
+    string path;
+    mapreduce::DictFile run;
+
+    explicit RunSource(const string& path) : path(path) {
+        if (!run.open(path)) cerr << "Error: cannot open spill run " << path << endl;
+    }
+
+    bool next() override {
+        if (!run.reader.next()) {
+            if (!run.reader.complete()) cerr << "Error: corrupt spill run " << path << endl;
+            return false;
+        }
+        key = run.reader.key();
+        count = run.reader.count();
+        return true;
+    }
+
+    bool failed() const override { return !run.reader.complete(); }
+};
+
+// False if a source ended on an error; what was emitted up to then is then incomplete.
+template <class Emit>
+bool kway_merge(vector<unique_ptr<MergeSource>>& sources, Emit emit) {
+    auto later = [](MergeSource* a, MergeSource* b) { return a->key > b->key; };
+    priority_queue<MergeSource*, vector<MergeSource*>, decltype(later)> heap(later);
+    for (auto& s : sources) {
+        if (s->next()) heap.push(s.get());
+    }
+
+    string current;
+    uint64_t total = 0;
+    while (!heap.empty()) {
+        MergeSource* s = heap.top();
+        heap.pop();
+        if (total > 0 && s->key != current) {
+            emit(string_view(current), total);
+            total = 0;
+        }
+        if (total == 0) current.assign(s->key.data(), s->key.size());
+        total += s->count;
+        if (s->next()) heap.push(s);
+    }
+    if (total > 0) emit(string_view(current), total);
+    for (const auto& s : sources) {
+        if (s->failed()) return false;
+    }
+    return true;
+}
+
+// Merges groups of run files into bigger runs until at most MAX_MERGE_FANIN are left open.
+bool reduce_run_count(SpillManager& spills) {
+    while (spills.runs.size() > MAX_MERGE_FANIN) {
+        vector<unique_ptr<MergeSource>> group;
+        for (size_t i = 0; i < MAX_MERGE_FANIN; ++i) {
+            group.push_back(make_unique<RunSource>(spills.runs[i]));
+        }
+        string path = spills.new_run_path();
+        mapreduce::DictWriter out(path.c_str());
+        if (!out.ok()) return false;
+        bool merged = kway_merge(group, [&](string_view key, uint64_t count) { out.add(key, count); });
+        if (!out.finish() || !merged) return false;
+        group.clear();
+        for (size_t i = 0; i < MAX_MERGE_FANIN; ++i) unlink(spills.runs[i].c_str());
+        spills.runs.erase(spills.runs.begin(), spills.runs.begin() + MAX_MERGE_FANIN);
+        spills.runs.push_back(path);
+    }
+    return true;
+}
+
+// Replaces dir/name with contents so that a crash leaves either the old or the new file:
+// write a temporary, fsync it, rename it over the old one, fsync the directory.
+bool replace_file(const string& dir, const string& name, const string& contents) {
+    string path = dir + "/" + name, tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) return false;
+    bool written = fwrite(contents.data(), 1, contents.size(), f) == contents.size() &&
+                   fflush(f) == 0 && fsync(fileno(f)) == 0;
+    written = fclose(f) == 0 && written;
+    if (!written || rename(tmp.c_str(), path.c_str()) == -1) return false;
+    int d = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (d == -1) return false;
+    bool synced = fsync(d) == 0;
+    close(d);
+    return synced;
+}
+
+//CHECKPOINT: --checkpoint DIR keeps the counts of finished splits as runs next to a
+// manifest naming them, so a restarted job only maps the splits that are still missing.
+//   wordcount-checkpoint 1
+//   input <size> <mtime_ns> <inode> <path>
+//   splits <count>
+//   run <file> <split>...
+// A run is on disk before the manifest names it and the manifest is replaced atomically
+// (write, fsync, rename, fsync of the directory), so a crash at any point leaves a
+// consistent checkpoint; at worst the splits since the last save are mapped again.
+class Checkpoint {
+public:
+    struct Run {
+        string file;            // inside dir
+        vector<size_t> splits;
+    };
+
+    // `input` identifies the input file (see input_identity); num_splits is the layout
+    // for a fresh start, a resumed job keeps the one it was checkpointed with.
+    Checkpoint(const string& dir, const string& input, size_t num_splits)
+        : num_splits(num_splits), dir(dir), input(input) {}
+
+    // Picks up the manifest of an earlier run over the same input; any other state in the
+    // directory is discarded. False if the directory cannot be used.
+    bool open() {
+        if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return false;
+        ifstream manifest(dir + "/manifest");
+        string line, word, header, recorded_input;
+        size_t recorded_splits = 0;
+        vector<Run> recorded;
+        getline(manifest, header);
+        while (getline(manifest, line)) {
+            istringstream fields(line);
+            fields >> word;
+            if (word == "input") {
+                getline(fields >> ws, recorded_input);
+            } else if (word == "splits") {
+                fields >> recorded_splits;
+            } else if (word == "run") {
+                Run run;
+                size_t split;
+                fields >> run.file;
+                while (fields >> split) run.splits.push_back(split);
+                struct stat st;
+                if (stat((dir + "/" + run.file).c_str(), &st) == 0) recorded.push_back(run);
+            }
+        }
+        if (header == "wordcount-checkpoint 1" && recorded_input == input && recorded_splits > 0) {
+            num_splits = recorded_splits;
+            runs = std::move(recorded);
+            resumed = true;
+        }
+
+        // Drop runs the manifest does not name: leftovers of a crash mid-save or an old job.
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* entry = readdir(d)) {
+                string name = entry->d_name;
+                if (name.compare(0, 4, "run-") != 0) continue;
+                next_id = max(next_id, atoi(name.c_str() + 4) + 1);
+                bool named = any_of(runs.begin(), runs.end(), [&](const Run& r) { return r.file == name; });
+                if (!named) unlink((dir + "/" + name).c_str());
+            }
+            closedir(d);
+        }
+        lock_guard<mutex> lock(m);
+        return write_manifest();
+    }
+
+    // Saves the tables as one run for their pending splits and empties them.
+    bool save(MapperTables& tables) {
+        string file = new_run_file();
+        mapreduce::DictWriter out((dir + "/" + file).c_str());
+        if (!out.ok()) return false;
+        for (const auto* s : sorted_entries(tables.partitions, 1)) out.add(s->key, s->count);
+        if (!out.finish(true)) return false;
+
+        lock_guard<mutex> lock(m);
+        runs.push_back(Run{file, tables.pending_splits});
+        tables.clear();
+        return write_manifest();
+    }
+
+    // Merges runs until at most MAX_MERGE_FANIN are left, keeping the manifest in step.
+    bool compact() {
+        while (runs.size() > MAX_MERGE_FANIN) {
+            vector<unique_ptr<MergeSource>> group;
+            Run merged{new_run_file(), {}};
+            for (size_t i = 0; i < MAX_MERGE_FANIN; ++i) {
+                group.push_back(make_unique<RunSource>(dir + "/" + runs[i].file));
+                merged.splits.insert(merged.splits.end(), runs[i].splits.begin(), runs[i].splits.end());
+            }
+            mapreduce::DictWriter out((dir + "/" + merged.file).c_str());
+            if (!out.ok()) return false;
+            bool complete = kway_merge(group, [&](string_view key, uint64_t count) { out.add(key, count); });
+            if (!out.finish(true) || !complete) return false;
+            group.clear();
+
+            vector<Run> old(runs.begin(), runs.begin() + MAX_MERGE_FANIN);
+            runs.erase(runs.begin(), runs.begin() + MAX_MERGE_FANIN);
+            runs.push_back(std::move(merged));
+            lock_guard<mutex> lock(m);
+            if (!write_manifest()) return false;
+            for (const auto& run : old) unlink((dir + "/" + run.file).c_str());
+        }
+        return true;
+    }
+
+    vector<bool> done_splits() const {
+        vector<bool> done(num_splits);
+        for (const auto& run : runs) {
+            for (size_t split : run.splits) {
+                if (split < num_splits) done[split] = true;
+            }
+        }
+        return done;
+    }
+
+    vector<string> run_paths() const {
+        vector<string> paths;
+        for (const auto& run : runs) paths.push_back(dir + "/" + run.file);
+        return paths;
+    }
+
+    // The job finished: its output supersedes the checkpoint.
+    void remove() {
+        for (const auto& run : runs) unlink((dir + "/" + run.file).c_str());
+        unlink((dir + "/manifest").c_str());
+        runs.clear();
+    }
+
+    size_t num_splits;
+    bool resumed = false;
+    vector<Run> runs;
+
+private:
+    string new_run_file() {
+        lock_guard<mutex> lock(m);
+        return "run-" + to_string(next_id++) + ".dict";
+    }
+
+    // Caller holds m.
+    bool write_manifest() {
+        string text = "wordcount-checkpoint 1\ninput " + input + "\nsplits " + to_string(num_splits) + "\n";
+        for (const auto& run : runs) {
+            text += "run " + run.file;
+            for (size_t split : run.splits) text += " " + to_string(split);
+            text += "\n";
+        }
+        return replace_file(dir, "manifest", text);
+    }
+
+    string dir, input;
+    mutex m;
+    int next_id = 0;
+};
+
+// "<size> <mtime_ns> <inode> <realpath>", or empty if the file cannot be examined.
+string input_identity(const char* path, uint64_t& size) {
+    struct stat st;
+    char real[PATH_MAX];
+    if (stat(path, &st) != 0 || !realpath(path, real)) return "";
+    size = st.st_size;
+    return to_string(st.st_size) + " " + to_string(st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) +
+           " " + to_string(st.st_ino) + " " + real;
+}
+
+//INCREMENTAL: --incremental keeps the counts of the input up to its last whitespace byte
+// next to the output, so a rerun over a file that only grew tokenizes just the new bytes.
+//   wordcount_output.state   wordcount-incremental 3
+//                            input <device> <inode> <realpath>
+//                            offset <bytes counted>
+//                            check <hash of the first and last INCREMENTAL_WINDOW bytes of [0, offset)>
+//                            counts <generation>      (wordcount_output.<generation>.dict)
+// The word the end of the file may cut in half is counted in the output only. Counts go to
+// a new generation before the state is replaced, so an interrupted run keeps the old one.
+// The input is trusted to be append-only: the check reads two bounded windows, so a rerun
+// costs the new bytes rather than a pass over the counted ones, and catches a file that
+// was replaced or truncated and rewritten, not an edit in the middle of the old bytes.
+const char* const INCREMENTAL_STATE = "wordcount_output.state";
+const uint64_t INCREMENTAL_WINDOW = 64 << 10;
+
+struct IncrementalState {
+    string input, check;
+    uint64_t offset = 0;
+    int generation = 0;        // 0: no counts yet
+
+    string counts_file() const { return "wordcount_output." + to_string(generation) + ".dict"; }
+
+    bool load() {
+        ifstream file(INCREMENTAL_STATE);
+        string line, word, header;
+        getline(file, header);
+        while (getline(file, line)) {
+            istringstream fields(line);
+            fields >> word;
+            if (word == "input") {
+                getline(fields >> ws, input);
+            } else if (word == "offset") {
+                fields >> offset;
+            } else if (word == "check") {
+                fields >> check;
+            } else if (word == "counts") {
+                fields >> generation;
+            }
+        }
+        return header == "wordcount-incremental 3" && generation > 0;
+    }
+
+    bool save() const {
+        return replace_file(".", INCREMENTAL_STATE,
+                            "wordcount-incremental 3\ninput " + input + "\noffset " + to_string(offset) +
+                            "\ncheck " + check + "\ncounts " + to_string(generation) + "\n");
+    }
+};
+
+// Hash of the head and tail windows of content[0, offset), eight bytes per step: tells a
+// file that only grew from one that was replaced in place. Not meant to resist deliberate
+// collisions.
+string prefix_hash(string_view content, uint64_t offset) {
+    const uint64_t K = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = offset * K;
+    auto feed = [&](uint64_t begin, uint64_t end) {
+        uint64_t i = begin;
+        for (; i + 8 <= end; i += 8) {
+            uint64_t w;
+            memcpy(&w, content.data() + i, 8);
+            h = (h ^ w) * K;
+            h ^= h >> 32;
+        }
+        for (; i < end; ++i) h = ((h ^ (unsigned char)content[i]) * K) ^ (h >> 32);
+    };
+    uint64_t head = min(offset, INCREMENTAL_WINDOW);
+    feed(0, head);
+    feed(max(head, offset - min(offset, INCREMENTAL_WINDOW)), offset);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+    return hex;
+}
+
+// Prints the timing report and writes --stats-json if it was requested.
+void report_stats(JobStats& stats, const Options& opt) {
+    stats.finish();
+    stats.print(cout);
+    if (!opt.stats_json.empty() && !stats.write_json(opt.stats_json)) {
+        cerr << "Warning: could not write " << opt.stats_json << endl;
+    }
+}
+
+//APPROX: mergeable sketches for --approx; memory depends on the error bounds, not on the input
+// Sketches need well-mixed bits, FNV-1a alone is weak in its high bits.
+inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Count-Min Sketch: estimates never undercount and overcount by at most eps * N
+// with probability 1 - delta, where N is the total number of words.
+class CountMinSketch {
+public:
+    CountMinSketch() = default;    // empty placeholder, only ever assigned over
+    CountMinSketch(double eps, double delta)
+        : width(max<size_t>(16, ceil(exp(1.0) / eps))),
+          depth(max<size_t>(1, ceil(log(1.0 / delta)))),
+          cells(width * depth) {}
+
+    // Adds n occurrences and returns the updated estimate for the same word.
+    uint64_t add(uint64_t hash, uint64_t n = 1) {
+        uint64_t h1 = mix64(hash), h2 = mix64(hash ^ 0x9e3779b97f4a7c15ULL) | 1;
+        uint64_t est = UINT64_MAX;
+        for (size_t row = 0; row < depth; ++row) {
+            uint64_t& cell = cells[row * width + (h1 + row * h2) % width];
+            cell += n;
+            est = min(est, cell);
+        }
+        return est;
+    }
+
+    uint64_t estimate(uint64_t hash) const {
+        uint64_t h1 = mix64(hash), h2 = mix64(hash ^ 0x9e3779b97f4a7c15ULL) | 1;
+        uint64_t est = UINT64_MAX;
+        for (size_t row = 0; row < depth; ++row) {
+            est = min(est, cells[row * width + (h1 + row * h2) % width]);
+        }
+        return est;
+    }
+
+    void merge(const CountMinSketch& other) {
+        for (size_t i = 0; i < cells.size(); ++i) cells[i] += other.cells[i];
+    }
+
+private:
+    size_t width = 0, depth = 0;
+    vector<uint64_t> cells;
+};
+
+// HyperLogLog with 2^p registers, standard error about 1.04 / sqrt(2^p).
+class HyperLogLog {
+public:
+    HyperLogLog() = default;       // empty placeholder, only ever assigned over
+    explicit HyperLogLog(int p) : p(p), registers(size_t(1) << p) {}
+
+    void add(uint64_t hash) {
+        uint64_t h = mix64(hash);
+        size_t index = h >> (64 - p);
+        uint8_t rank = __builtin_clzll((h << p) | (1ULL << (p - 1))) + 1;
+        registers[index] = max(registers[index], rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < registers.size(); ++i) registers[i] = max(registers[i], other.registers[i]);
+    }
+
+    // Ertl's improved estimator ("New cardinality estimation algorithms for HyperLogLog
+    // sketches", 2017): unbiased over the whole range without empirical bias tables.
+    double estimate() const {
+        const int q = 64 - p;
+        vector<size_t> hist(q + 2);
+        for (uint8_t r : registers) hist[r]++;
+        double m = registers.size();
+        double z = m * tau(1 - hist[q + 1] / m);
+        for (int k = q; k >= 1; --k) z = 0.5 * (z + hist[k]);
+        z += m * sigma(hist[0] / m);
+        return 0.5 / log(2.0) * m * m / z;
+    }
+
+    double relative_error() const { return 1.04 / sqrt((double)registers.size()); }
+
+private:
+    static double sigma(double x) {
+        if (x == 1) return INFINITY;
+        double y = 1, z = x, prev;
+        do {
+            x *= x;
+            prev = z;
+            z += x * y;
+            y += y;
+        } while (z != prev);
+        return z;
+    }
+
+    static double tau(double x) {
+        if (x == 0 || x == 1) return 0;
+        double y = 1, z = 1 - x, prev;
+        do {
+            x = sqrt(x);
+            prev = z;
+            y *= 0.5;
+            z -= (1 - x) * (1 - x) * y;
+        } while (z != prev);
+        return z / 3;
+    }
+
+    int p = 0;
+    vector<uint8_t> registers;
+};
+
+// Per-mapper state: the sketches plus a bounded set of heavy-hitter candidates (the
+// words whose running estimate cleared the candidate threshold), kept in a WordTable
+// whose counts hold the latest estimate.
+class ApproxCounter {
+public:
+    ApproxCounter(const Options& opt, size_t capacity)
+        : cms(opt.eps, opt.delta), hll(opt.hll_precision), capacity(capacity) {}
+
+    void add(string_view word) {
+        uint64_t h = hash_word(word);
+        hll.add(h);
+        uint64_t est = cms.add(h);
+        if (est < threshold) return;
+        candidates.set(word, h, est, arena);
+        if (candidates.size() > 2 * capacity) prune();
+    }
+
+    void merge_into(CountMinSketch& total_cms, HyperLogLog& total_hll) const {
+        total_cms.merge(cms);
+        total_hll.merge(hll);
+    }
+
+    Arena arena;
+    WordTable candidates;
+
+private:
+    // Keeps the best `capacity` candidates; later words must beat the weakest of them.
+    void prune() {
+        vector<pair<uint64_t, string>> kept;
+        candidates.for_each([&](const WordTable::Slot& s) { kept.emplace_back(s.count, string(s.key)); });
+        nth_element(kept.begin(), kept.begin() + capacity, kept.end(),
+                    [](const auto& a, const auto& b) { return a.first > b.first; });
+        kept.resize(capacity);
+        candidates.clear();
+        arena.reset();
+        threshold = UINT64_MAX;
+        for (const auto& k : kept) {
+            candidates.set(k.second, hash_word(k.second), k.first, arena);
+            threshold = min(threshold, k.first);
+        }
+    }
+
+    CountMinSketch cms;
+    HyperLogLog hll;
+    size_t capacity;
+    uint64_t threshold = 0;
+};
+
+//JOBS: the engine policies. Exact counting is WordMapper + CountCombiner + PartitionReducer,
+// --approx swaps in SketchCombiner + SketchReducer.
+struct WordMapper {
+    static bool is_boundary(unsigned char c) { return BYTE_CLASSES.space[c]; }
+
+    template <class Emit>
+    uint64_t operator()(string_view split, uint64_t, Emit& emit) const {
+        string scratch;
+        uint64_t words = 0;
+        tokenize(split, scratch, [&](string_view word) {
+            emit(word);
+            words++;
+        });
+        return words;
+    }
+};
+
+// Counts go straight into the partition table the key hashes to, so the local
+// aggregation and the shuffle are one step. With a SpillManager (--stream), a worker
+// whose tables outgrow its share of the budget writes them out as a sorted run; with a
+// Checkpoint, every checkpoint_every splits.
+struct CountCombiner {
+    using Local = MapperTables;
+
+    size_t num_partitions;
+    SpillManager* spills = nullptr;
+    size_t budget = 0;
+    atomic<bool>* failed = nullptr;    // set when a spill or checkpoint cannot be written
+    Checkpoint* checkpoint = nullptr;
+    size_t checkpoint_every = 0;
+
+    Local make_local() const { return MapperTables(num_partitions); }
+
+    void operator()(Local& local, string_view word) const {
+        uint64_t h = hash_word(word);
+        local.partitions[partition_of(h, num_partitions)].add(word, h, 1, local.arena);
+    }
+
+    void after_split(Local& local, size_t split) const {
+        if (spills && local.memory_bytes() > budget && !spills->spill(local)) *failed = true;
+        if (checkpoint) {
+            local.pending_splits.push_back(split);
+            if (local.pending_splits.size() >= checkpoint_every && !checkpoint->save(local)) *failed = true;
+        }
+    }
+};
+
+// Each reducer owns one partition, so reducers merge disjoint key sets in parallel. The
+// merged table references the mapper arenas' keys, which the engine keeps alive. With
+// --top each reducer also ranks its own partition; since partitions hold disjoint words,
+// the global top K is the top K of these partial lists.
+struct PartitionReducer {
+    struct Partial {
+        WordTable table;
+        vector<const WordTable::Slot*> top;
+    };
+
+    size_t top_k;
+    uint64_t min_count;
+
+    size_t partitions(size_t num_threads) const { return num_threads; }
+
+    Partial operator()(size_t partition, vector<MapperTables>& locals) const {
+        Partial result;
+        for (const auto& local : locals) {
+            local.partitions[partition].for_each([&](const WordTable::Slot& s) {
+                result.table.add(s.key, s.hash, s.count);
+            });
+        }
+        if (top_k) {
+            result.table.for_each([&](const WordTable::Slot& s) {
+                if (s.count >= min_count) result.top.push_back(&s);
+            });
+            keep_top(result.top, top_k);
+        }
+        return result;
+    }
+};
+
+struct SketchCombiner {
+    using Local = ApproxCounter;
+
+    const Options* opt;
+    size_t capacity;
+
+    Local make_local() const { return ApproxCounter(*opt, capacity); }
+    void operator()(Local& local, string_view word) const { local.add(word); }
+};
+
+// Merging sketches is a cell-wise sum / max: constant memory whatever the input. The
+// candidate keys stay in the mappers' arenas; counts are the merged estimates.
+struct SketchReducer {
+    struct Partial {
+        CountMinSketch cms;
+        HyperLogLog hll;
+        WordTable candidates;
+    };
+
+    const Options* opt;
+
+    size_t partitions(size_t) const { return 1; }
+
+    Partial operator()(size_t, vector<ApproxCounter>& locals) const {
+        Partial result{CountMinSketch(opt->eps, opt->delta), HyperLogLog(opt->hll_precision), WordTable()};
+        for (const auto& c : locals) {
+            c.merge_into(result.cms, result.hll);
+            c.candidates.for_each([&](const WordTable::Slot& s) { result.candidates.set(s.key, s.hash, 1); });
+        }
+        result.candidates.for_each([&](WordTable::Slot& s) { s.count = result.cms.estimate(s.hash); });
+        return result;
+    }
+};
+
+// Parses [-j N] [--stream] [--mem-budget SIZE] [--block-size SIZE] [--spill-dir DIR]
+// [--top K] [--min-count N] [--approx [--eps E] [--delta D] [--hll-p P]] [--stats-json FILE]
+// [--checkpoint DIR [--checkpoint-every N]] [--incremental] [--workers ADDR,...]
+// <input>..., or [-j N] --worker ADDR [--root DIR]. An input is a file, a directory or a
+// glob pattern; anything else starting with '-' is refused rather than taken as an input.
+bool parse_args(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-j" && has_value) {
+            if (!parse_number(argv[++i], opt.engine.num_threads)) return false;
+        } else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2) {
+            if (!parse_number(arg.c_str() + 2, opt.engine.num_threads)) return false;
+        } else if (arg == "--stream") {
+            opt.stream = true;
+        } else if (arg == "--mem-budget" && has_value) {
+            opt.mem_budget = parse_size(argv[++i]);
+            if (opt.mem_budget == 0) return false;
+        } else if (arg == "--block-size" && has_value) {
+            opt.engine.block_size = parse_size(argv[++i]);
+            if (opt.engine.block_size == 0) return false;
+        } else if (arg == "--spill-dir" && has_value) {
+            opt.spill_dir = argv[++i];
+        } else if (arg == "--top" && has_value) {
+            if (!parse_number(argv[++i], opt.top_k)) return false;
+        } else if (arg == "--min-count" && has_value) {
+            if (!parse_number(argv[++i], opt.min_count)) return false;
+        } else if (arg == "--approx") {
+            opt.approx = true;
+        } else if (arg == "--eps" && has_value) {
+            if (!parse_number(argv[++i], opt.eps)) return false;
+        } else if (arg == "--delta" && has_value) {
+            if (!parse_number(argv[++i], opt.delta)) return false;
+        } else if (arg == "--hll-p" && has_value) {
+            if (!parse_number(argv[++i], opt.hll_precision)) return false;
+        } else if (arg == "--stats-json" && has_value) {
+            opt.stats_json = argv[++i];
+        } else if (arg == "--checkpoint" && has_value) {
+            opt.checkpoint_dir = argv[++i];
+        } else if (arg == "--checkpoint-every" && has_value) {
+            if (!parse_number(argv[++i], opt.checkpoint_every) || opt.checkpoint_every == 0) return false;
+        } else if (arg == "--incremental") {
+            opt.incremental = true;
+        } else if (arg == "--worker" && has_value) {
+            opt.worker_addr = argv[++i];
+        } else if (arg == "--root" && has_value) {
+            opt.worker_root = argv[++i];
+        } else if (arg == "--workers" && has_value) {
+            opt.workers = mapreduce::split_list(argv[++i]);
+            if (opt.workers.empty()) return false;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;    // an unknown option, or one missing its value; "-" is stdin
+        } else {
+            opt.inputs.push_back(argv[i]);
+        }
+    }
+    if (!opt.worker_addr.empty()) return opt.inputs.empty() && opt.engine.num_threads >= 1;
+    if (!opt.workers.empty() && (opt.stream || opt.approx)) return false;
+    if (!opt.checkpoint_dir.empty() && (opt.stream || opt.approx || !opt.workers.empty())) return false;
+    if (opt.incremental && (opt.stream || opt.approx || !opt.workers.empty() || !opt.checkpoint_dir.empty())) {
+        return false;
+    }
+    return !opt.inputs.empty() && opt.engine.num_threads >= 1 && opt.engine.block_size > 0 &&
+           opt.eps > 0 && opt.delta > 0 && opt.delta < 1 &&
+           opt.hll_precision >= 4 && opt.hll_precision <= 20;
+}
+
+// Reports an input map_file() could not open, with the reason it left in errno.
+void report_unreadable(const char* path) {
+    cerr << "Error: Could not read file " << path << ": " << strerror(errno) << endl;
+}
+
+// A single file is mapped as a whole; several are scheduled as (file, range) tasks
+// (map_files() names the file it could not read itself).
+template <class Job>
+bool map_input(Job& job, const Options& opt) {
+    if (opt.inputs.size() > 1) return job.map_files(opt.inputs);
+    if (job.map_file(opt.filename)) return true;
+    report_unreadable(opt.filename);
+    return false;
+}
+
+// Merges sorted runs and in-memory tables straight into the output file: words come out
+// in sorted order, or through a bounded heap for --top.
+int write_merged(const Options& opt, const vector<string>& runs, const vector<MapperTables>& tables,
+                 JobStats& stats) {
+    //REDUCE + OUTPUT
+    stats.phase("reduce+output");
+    cout << "[Master] Merging " << runs.size() << " runs and "
+         << tables.size() << " in-memory tables..." << endl;
+    vector<unique_ptr<MergeSource>> sources;
+    for (const auto& path : runs) sources.push_back(make_unique<RunSource>(path));
+    for (const auto& t : tables) sources.push_back(make_unique<TableSource>(t));
+
+    LineWriter outfile("wordcount_output.txt", ": ");
+    if (!outfile.ok()) return 1;
+    size_t unique_words = 0;
+    TopK top(opt.top_k);
+    bool merged = kway_merge(sources, [&](string_view key, uint64_t count) {
+        unique_words++;
+        if (count < opt.min_count) return;
+        if (opt.top_k) {
+            top.add(key, count);
+        } else {
+            outfile.write(key, count);
+        }
+    });
+    if (!merged) return 1;    // the run that failed has been reported
+    for (const auto& entry : top.sorted()) outfile.write(entry.first, entry.second);
+    outfile.close();
+    cout << "[Master] Success! Unique words: " << unique_words << endl;
+    report_stats(stats, opt);
+    return 0;
+}
+
+int run_streaming(const Options& opt) {
+    const size_t num_threads = opt.engine.num_threads;
+    cout << "[Master] Streaming " << opt.filename << " in " << (opt.engine.block_size >> 10) << " KB blocks, "
+         << "table budget " << (opt.mem_budget >> 10) << " KB, " << num_threads << " threads..." << endl;
+
+    JobStats stats("wordcount", "words", num_threads);
+    SpillManager spills(opt.spill_dir);
+    atomic<bool> spill_failed{false};
+    CountCombiner combiner{num_threads, &spills, max<size_t>(opt.mem_budget / num_threads, 1), &spill_failed};
+    MapReduce job(WordMapper(), combiner, PartitionReducer{opt.top_k, opt.min_count}, opt.engine, stats);
+
+    if (!job.map_stream(opt.filename)) {
+        perror(opt.filename);
+        return 1;
+    }
+    cout << "[Master] Map phase complete: " << job.input_bytes() << " bytes, "
+         << spills.runs.size() << " spilled runs." << endl;
+    stats.phase("run merge");
+    if (spill_failed || !reduce_run_count(spills)) {
+        cerr << "Error: could not write spill runs to " << opt.spill_dir << endl;
         return 1;
     }
 
-    //INPUT
-    ifstream file(argv[1]);
-    if (!file.is_open()) return 1;
-    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
-    cout << "[Master] Read file size: " << content.length() << " bytes." << endl;
+    return write_merged(opt, spills.runs, job.locals(), stats);
+}
 
-    //SPLIT
-    vector<string> chunks(NUM_THREADS);
-    size_t chunk_size = content.length() / NUM_THREADS;
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        chunks[i] = (i == NUM_THREADS - 1) ? 
-            content.substr(i * chunk_size) : 
-            content.substr(i * chunk_size, chunk_size);
+int run_checkpointed(const Options& opt) {
+    uint64_t size = 0;
+    string input = input_identity(opt.filename, size);
+    if (input.empty()) {
+        perror(opt.filename);
+        return 1;
+    }
+    Checkpoint checkpoint(opt.checkpoint_dir, input, opt.engine.splits_for(size));
+    if (!checkpoint.open()) {
+        cerr << "Error: cannot use checkpoint directory " << opt.checkpoint_dir << endl;
+        return 1;
+    }
+    // The split layout is part of the checkpoint: a resumed job cuts the input the same way.
+    mapreduce::Config config = opt.engine;
+    config.num_splits = checkpoint.num_splits;
+    vector<bool> done = checkpoint.done_splits();
+    size_t finished = count(done.begin(), done.end(), true);
+    if (checkpoint.resumed) {
+        cout << "[Master] Resuming from " << opt.checkpoint_dir << ": " << finished << " of "
+             << config.num_splits << " splits already counted in " << checkpoint.runs.size() << " runs." << endl;
+    } else {
+        cout << "[Master] Checkpointing to " << opt.checkpoint_dir << " every " << opt.checkpoint_every
+             << " splits per thread." << endl;
     }
 
-    //MAP
-    cout << "[Master] Starting " << NUM_THREADS << " threads..." << endl;
-    vector<thread> threads;
-    vector<map<string, int>> intermediate_results(NUM_THREADS);
+    const size_t num_threads = config.num_threads;
+    JobStats stats("wordcount", "words", num_threads);
+    atomic<bool> failed{false};
+    CountCombiner combiner{num_threads, nullptr, 0, &failed, &checkpoint, opt.checkpoint_every};
+    MapReduce job(WordMapper(), combiner, PartitionReducer{opt.top_k, opt.min_count}, config, stats);
+    job.skip_splits(std::move(done));
 
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        threads.push_back(thread(map_function, ref(chunks[i]), ref(intermediate_results[i])));
+    cout << "[Master] Starting " << num_threads << " threads on " << config.num_splits - finished
+         << " splits..." << endl;
+    if (!job.map_file(opt.filename)) {
+        report_unreadable(opt.filename);
+        return 1;
     }
+    cout << "[Master] Map phase complete." << endl;
+    stats.phase("run merge");
+    if (failed || !checkpoint.compact()) {
+        cerr << "Error: could not write the checkpoint to " << opt.checkpoint_dir << endl;
+        return 1;
+    }
+
+    int status = write_merged(opt, checkpoint.run_paths(), job.locals(), stats);
+    if (status == 0) checkpoint.remove();
+    return status;
+}
 
-    for (auto& t : threads) t.join();
+int run_incremental(const Options& opt) {
+    mapreduce::MappedFile input;
+    struct stat st;
+    char real[PATH_MAX];
+    if (!input.open(opt.filename) || stat(opt.filename, &st) != 0 || !realpath(opt.filename, real)) {
+        perror(opt.filename);
+        return 1;
+    }
+    string_view content = input.view();
+    string identity = to_string(st.st_dev) + " " + to_string(st.st_ino) + " " + real;
+
+    // The stored counts carry over only if this is the same file and the ends of the bytes
+    // they covered are unchanged; anything else (rotated, truncated, rewritten) recounts.
+    IncrementalState loaded, previous;
+    bool have_state = loaded.load();
+    struct stat counts_st;
+    if (have_state && loaded.input == identity && loaded.offset <= content.size() &&
+        loaded.check == prefix_hash(content, loaded.offset) && stat(loaded.counts_file().c_str(), &counts_st) == 0) {
+        previous = loaded;
+        cout << "[Master] Incremental: " << content.size() - previous.offset << " new bytes after offset "
+             << previous.offset << "." << endl;
+    } else {
+        cout << "[Master] Incremental: no usable state for " << opt.filename << ", counting from the start." << endl;
+    }
+
+    // Only whole words go into the state: stop after the last whitespace byte.
+    uint64_t cut = content.size();
+    while (cut > previous.offset && !WordMapper::is_boundary(content[cut - 1])) cut--;
+
+    const size_t num_threads = opt.engine.num_threads;
+    JobStats stats("wordcount", "words", num_threads);
+    MapReduce job(WordMapper(), CountCombiner{num_threads}, PartitionReducer{opt.top_k, opt.min_count},
+                  opt.engine, stats);
+    cout << "[Master] Starting " << num_threads << " threads..." << endl;
+    if (!job.map_file(opt.filename, previous.offset, cut)) {
+        report_unreadable(opt.filename);
+        return 1;
+    }
     cout << "[Master] Map phase complete." << endl;
 
-    //REDUCE
-    cout << "[Master] Reducing..." << endl;
-    map<string, int> final_result;
-    reduce_function(intermediate_results, final_result);
+    IncrementalState next = previous;
+    if (cut > previous.offset) {
+        stats.phase("state");
+        next = IncrementalState{identity, prefix_hash(content, cut), cut, max(loaded.generation, 0) + 1};
+        vector<unique_ptr<MergeSource>> sources;
+        if (previous.generation) sources.push_back(make_unique<RunSource>(previous.counts_file()));
+        for (const auto& t : job.locals()) sources.push_back(make_unique<TableSource>(t));
+        mapreduce::DictWriter out(next.counts_file().c_str());
+        bool merged = out.ok() && kway_merge(sources, [&](string_view key, uint64_t count) { out.add(key, count); });
+        sources.clear();
+        if (!out.finish(true) || !merged || !next.save()) {
+            cerr << "Error: could not write the incremental state " << INCREMENTAL_STATE << endl;
+            return 1;
+        }
+        if (have_state) unlink(loaded.counts_file().c_str());
+    }
+
+    vector<MapperTables> tail;
+    tail.emplace_back(1);
+    string scratch;
+    tokenize(content.substr(cut), scratch, [&](string_view word) {
+        tail[0].partitions[0].add(word, hash_word(word), 1, tail[0].arena);
+    });
+    vector<string> runs;
+    if (next.generation) runs.push_back(next.counts_file());
+    return write_merged(opt, runs, tail, stats);
+}
 
-    //OUTPUT
-    ofstream outfile("wordcount_output.txt");
-    for (const auto& pair : final_result) {
-        outfile << pair.first << ": " << pair.second << endl;
+int run_approx(const Options& opt) {
+    const size_t k = opt.top_k ? opt.top_k : DEFAULT_APPROX_TOP;
+    JobStats stats("wordcount", "words", opt.engine.num_threads);
+    MapReduce job(WordMapper(), SketchCombiner{&opt, 4 * k}, SketchReducer{&opt}, opt.engine, stats);
+
+    cout << "[Master] Approximate mode: eps=" << opt.eps << " delta=" << opt.delta
+         << " hll_p=" << opt.hll_precision << ", " << opt.engine.num_threads << " threads..." << endl;
+    if (opt.stream && !job.map_stream(opt.filename)) {
+        perror(opt.filename);
+        return 1;
     }
+    if (!opt.stream && !map_input(job, opt)) return 1;
+    cout << "[Master] Map phase complete." << endl;
+
+    cout << "[Master] Merging " << opt.engine.num_threads << " sketches..." << endl;
+    SketchReducer::Partial merged = std::move(job.reduce()[0]);
+    vector<const WordTable::Slot*> ranked;
+    merged.candidates.for_each([&](const WordTable::Slot& s) {
+        if (s.count >= opt.min_count) ranked.push_back(&s);
+    });
+    keep_top(ranked, k);
+
+    stats.phase("output");
+    LineWriter outfile("wordcount_output.txt", ": ");
+    if (!outfile.ok()) return 1;
+    for (const auto* s : ranked) outfile.write(s->key, s->count);
     outfile.close();
-    cout << "[Master] Success! Unique words: " << final_result.size() << endl;
+    cout << "[Master] Success! Unique words: ~" << (uint64_t)llround(merged.hll.estimate())
+         << " (HyperLogLog estimate, +/-" << 100 * merged.hll.relative_error() << "%)" << endl;
+    report_stats(stats, opt);
+    return 0;
+}
+
+// Writes the reduced partitions: every word sorted, or the top K, above --min-count.
+int write_counts(const Options& opt, const vector<PartitionReducer::Partial>& final_result, JobStats& stats) {
+    //OUTPUT: the only sort in the job, once over the merged (or ranked) result
+    stats.phase("output");
+    vector<const WordTable::Slot*> selected;
+    if (opt.top_k) {
+        for (const auto& part : final_result) selected.insert(selected.end(), part.top.begin(), part.top.end());
+        keep_top(selected, opt.top_k);
+    } else {
+        selected = sorted_entries(final_result, opt.min_count);
+    }
 
+    LineWriter outfile("wordcount_output.txt", ": ");
+    if (!outfile.ok()) return 1;
+    for (const auto* s : selected) outfile.write(s->key, s->count);
+    outfile.close();
+    size_t unique_words = 0;
+    for (const auto& part : final_result) unique_words += part.table.size();
+    cout << "[Master] Success! Unique words: " << unique_words << endl;
+    report_stats(stats, opt);
     return 0;
 }
+
+//DISTRIBUTED: a worker maps a byte range with its own threads, reduces it locally and
+// sends back its counts as a binary dictionary; the coordinator folds them into one
+// table set per worker connection and reduces those exactly like mapper tables.
+string serve_range(const Options& opt, const mapreduce::RangeRequest& request) {
+    JobStats stats("wordcount", "words", opt.engine.num_threads);
+    MapReduce job(WordMapper(), CountCombiner{opt.engine.num_threads}, PartitionReducer{0, 1}, opt.engine, stats);
+    if (!job.map_file(request.path.c_str(), request.begin, request.end)) return "ERROR cannot open " + request.path;
+    vector<PartitionReducer::Partial> parts = job.reduce();
+
+    string reply = "OK\n";
+    mapreduce::DictWriter out(reply);
+    for (const auto* s : sorted_entries(parts, 1)) out.add(s->key, s->count);
+    out.finish();
+    stats.finish();
+    cout << "[Worker] " << request.path << " [" << request.begin << ", " << request.end << "): "
+         << (reply.size() >> 10) << " KB reply" << endl;
+    return reply;
+}
+
+// Folds a worker's reply into one connection's tables; returns the number of words, -1 if malformed.
+int64_t merge_reply(string_view reply, MapperTables& tables) {
+    int64_t words = 0;
+    mapreduce::DictReader counts(reply.substr(3));     // past "OK\n"
+    while (counts.next()) {
+        uint64_t h = hash_word(counts.key());
+        tables.partitions[partition_of(h, tables.partitions.size())].add(counts.key(), h, counts.count(), tables.arena);
+        words += counts.count();
+    }
+    return counts.complete() ? words : -1;
+}
+
+int run_distributed(const Options& opt) {
+    char path[PATH_MAX];
+    if (!realpath(opt.filename, path)) {
+        perror(opt.filename);
+        return 1;
+    }
+    vector<int> connections;
+    for (const auto& addr : opt.workers) {
+        int fd = mapreduce::connect_to(addr);
+        if (fd == -1) {
+            cerr << "Error: cannot connect to worker " << addr << endl;
+            for (int c : connections) close(c);
+            return 1;
+        }
+        connections.push_back(fd);
+    }
+
+    // One engine slot per worker connection; the reduce runs on as many threads.
+    mapreduce::Config config = opt.engine;
+    config.num_threads = connections.size();
+    JobStats stats("wordcount", "words", config.num_threads);
+    MapReduce job(WordMapper(), CountCombiner{config.num_threads}, PartitionReducer{opt.top_k, opt.min_count},
+                  config, stats);
+
+    cout << "[Master] Coordinating " << connections.size() << " workers on " << path << "..." << endl;
+    bool mapped = job.map_ranges(path, connections.size() * mapreduce::RANGES_PER_WORKER,
+                                 [&](size_t slot, uint64_t begin, uint64_t end, MapperTables& tables) -> int64_t {
+        string reply;
+        mapreduce::RangeRequest request{path, begin, end, ""};
+        if (!mapreduce::send_message(connections[slot], request.encode()) ||
+            !mapreduce::recv_message(connections[slot], reply)) {
+            cerr << "Error: lost worker " << opt.workers[slot] << endl;
+            return -1;
+        }
+        if (reply.compare(0, 3, "OK\n") != 0) {
+            cerr << "Error: worker " << opt.workers[slot] << ": " << reply << endl;
+            return -1;
+        }
+        return merge_reply(reply, tables);
+    });
+    for (int c : connections) close(c);
+    if (!mapped) return 1;
+    cout << "[Master] Map phase complete: " << job.input_bytes() << " bytes." << endl;
+
+    cout << "[Master] Reducing " << config.num_threads << " partitions..." << endl;
+    return write_counts(opt, job.reduce(), stats);
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        cout << "Usage: ./wordcount [-j threads] [--stream] [--mem-budget SIZE] [--block-size SIZE] "
+                "[--spill-dir DIR] [--top K] [--min-count N] [--approx [--eps E] [--delta D] [--hll-p P]] "
+                "[--stats-json FILE] [--checkpoint DIR [--checkpoint-every N]] [--incremental] "
+                "[--workers ADDR,...] <file | dir | 'glob'>...\n"
+                "       ./wordcount [-j threads] --worker ADDR [--root DIR]\n"
+                "         (ADDR: host:port or unix:/path; DIR: the tree served, default .)" << endl;
+        return 1;
+    }
+    // every allocation pays an atomic add while counting, so only count when asked to
+    mapreduce::allocation_counting = !opt.stats_json.empty();
+    if (!opt.worker_addr.empty()) {
+        cout << "[Worker] Serving map tasks on " << opt.worker_addr << " with "
+             << opt.engine.num_threads << " threads..." << endl;
+        return mapreduce::serve(opt.worker_addr, opt.worker_root,
+                                [&](const mapreduce::RangeRequest& request) { return serve_range(opt, request); });
+    }
+
+    vector<string> paths;
+    if (!mapreduce::expand_inputs(opt.inputs, paths)) return 1;
+    if (paths.empty()) {
+        cerr << "Error: no input files" << endl;
+        return 1;
+    }
+    opt.inputs = std::move(paths);
+    opt.filename = opt.inputs[0].c_str();
+    bool single_file_mode = opt.stream || !opt.workers.empty() || !opt.checkpoint_dir.empty() || opt.incremental;
+    if (opt.inputs.size() > 1 && single_file_mode) {
+        cerr << "Error: --stream, --workers, --checkpoint and --incremental take a single input file" << endl;
+        return 1;
+    }
+
+    if (!opt.workers.empty()) return run_distributed(opt);
+    if (!opt.checkpoint_dir.empty()) return run_checkpointed(opt);
+    if (opt.incremental) return run_incremental(opt);
+    if (opt.approx) return run_approx(opt);
+    if (opt.stream) return run_streaming(opt);
+
+    const size_t num_threads = opt.engine.num_threads;
+    JobStats stats("wordcount", "words", num_threads);
+    MapReduce job(WordMapper(), CountCombiner{num_threads}, PartitionReducer{opt.top_k, opt.min_count},
+                  opt.engine, stats);
+
+    //INPUT + SPLIT + MAP
+    cout << "[Master] Starting " << num_threads << " threads..." << endl;
+    if (!map_input(job, opt)) return 1;
+    if (opt.inputs.size() > 1) {
+        cout << "[Master] Read " << job.input_bytes() << " bytes from " << opt.inputs.size() << " files." << endl;
+    } else {
+        cout << "[Master] Read file size: " << job.mapped_input().view().size() << " bytes"
+             << (job.mapped_input().is_mapped() ? " (mmap)." : ".") << endl;
+    }
+    cout << "[Master] Map phase complete." << endl;
+
+    //REDUCE
+    cout << "[Master] Reducing " << num_threads << " partitions..." << endl;
+    return write_counts(opt, job.reduce(), stats);
+}
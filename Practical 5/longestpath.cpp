@@ -1,92 +1,629 @@
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <thread>
-#include <sstream>
 #include <algorithm>
-#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <climits>
+#include <charconv>
+#include "../mapreduce/mapreduce.h"
+#include "../mapreduce/net.h"
+#include "../mapreduce/alloc_count.h"
 
 using namespace std;
+using mapreduce::JobStats;
+using mapreduce::MapReduce;
+using mapreduce::parse_number;
+using mapreduce::parse_size;
 
-const int NUM_THREADS = 4;
+// Lengths are histogrammed in bins of this many characters, everything at or past the
+// last bin (longer than PATH_MAX) lands in it.
+const size_t LENGTH_BIN = 16;
+const size_t LENGTH_BINS = 4096 / LENGTH_BIN + 1;
 
-void map_function(const string& text_chunk, string& local_max) {
-    stringstream ss(text_chunk);
-    string line;
-    local_max = "";
+struct Options {
+    mapreduce::Config engine;  // -j, --block-size
+    vector<string> inputs;     // files, directories or glob patterns
+    const char* filename = nullptr;    // the input, once expanded to a single file
+    bool stream = false;
+    const char* walk_root = nullptr;
+    size_t top_n = 1;
+    bool histogram = false;
+    string metric = "bytes";
+    string stats_json;
+    string worker_addr;        // --worker: serve map tasks instead of running a job
+    string worker_root = ".";  // --root: the only tree a worker reads files from
+    vector<string> workers;    // --workers: run the map phase on these workers
+};
 
-    while (getline(ss, line)) {
-        if (line.length() > local_max.length()) {
-            local_max = line;
-        }
+//METRICS: what "longest" means. Each is a policy the combiner is instantiated with, so
+// the default byte metric compiles to exactly the old length comparison.
+// Number of bytes b in [p, p + n) with (b & mask) == value, 32 or 16 bytes per step.
+inline uint64_t count_bytes(const char* p, size_t n, unsigned char mask, unsigned char value) {
+    uint64_t count = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i m = _mm256_set1_epi8((char)mask), v = _mm256_set1_epi8((char)value);
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        count += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(x, m), v)));
+    }
+#elif defined(__SSE2__)
+    const __m128i m = _mm_set1_epi8((char)mask), v = _mm_set1_epi8((char)value);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, m), v)));
     }
+#endif
+    for (; i < n; ++i) count += ((unsigned char)p[i] & mask) == value;
+    return count;
 }
 
-void reduce_function(const vector<string>& all_local_maxes, string& global_max) {
-    global_max = "";
-    for (const auto& path : all_local_maxes) {
-        if (path.length() > global_max.length()) {
-            global_max = path;
+inline uint64_t depth_of(string_view line) { return count_bytes(line.data(), line.length(), 0xFF, '/'); }
+
+struct ByteLength {
+    static constexpr const char* unit = "characters";
+    static uint64_t of(string_view line) { return line.length(); }
+};
+
+// Every UTF-8 codepoint has exactly one byte that is not a continuation byte (10xxxxxx).
+struct CodepointLength {
+    static constexpr const char* unit = "codepoints";
+    static uint64_t of(string_view line) { return line.length() - count_bytes(line.data(), line.length(), 0xC0, 0x80); }
+};
+
+struct ComponentDepth {
+    static constexpr const char* unit = "levels deep";
+    static uint64_t of(string_view line) { return depth_of(line); }
+};
+
+// Longest first, ties broken by position ("first longest path in the file wins") and,
+// for walked paths that have no position, by the path itself. So the result does not
+// depend on the split order or on which worker saw what.
+inline bool ranks_before(uint64_t length_a, uint64_t offset_a, string_view text_a,
+                         uint64_t length_b, uint64_t offset_b, string_view text_b) {
+    if (length_a != length_b) return length_a > length_b;
+    if (offset_a != offset_b) return offset_a < offset_b;
+    return text_a < text_b;
+}
+
+// A candidate path is only its position in the input; the bytes are fetched once, for
+// the winners, at the end. `text` is only filled when the input cannot be re-read
+// (streaming from stdin, walking a tree). `length` is in the chosen metric.
+struct Line {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t bytes = 0;
+    string text;
+
+    bool beats(const Line& other) const {
+        return ranks_before(length, offset, text, other.length, other.offset, other.text);
+    }
+};
+
+// Counts of lines per length bin (in the --metric unit, bytes for depth) and per depth
+// (number of '/' in the line).
+struct Histogram {
+    vector<uint64_t> lengths = vector<uint64_t>(LENGTH_BINS);
+    vector<uint64_t> depths;
+
+    void add(string_view line, uint64_t length) {
+        lengths[min<uint64_t>(length / LENGTH_BIN, LENGTH_BINS - 1)]++;
+        size_t depth = depth_of(line);
+        if (depth >= depths.size()) depths.resize(depth + 1);
+        depths[depth]++;
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < LENGTH_BINS; ++i) lengths[i] += other.lengths[i];
+        if (other.depths.size() > depths.size()) depths.resize(other.depths.size());
+        for (size_t i = 0; i < other.depths.size(); ++i) depths[i] += other.depths[i];
+    }
+};
+
+// Per-worker state: the N best lines as a heap whose top is the worst of them, so a new
+// line only has to beat that one to get in.
+struct Longest {
+    vector<Line> heap;
+    Histogram histogram;
+};
+
+inline bool line_beats(const Line& a, const Line& b) { return a.beats(b); }
+
+//JOBS: one line per record, each worker keeps its N best lines, one reducer merges them
+struct LineMapper {
+    static bool is_boundary(unsigned char c) { return c == '\n'; }
+
+    // Newlines are found with memchr (vectorized in libc), lines are never copied.
+    // Returns the number of lines scanned.
+    template <class Emit>
+    uint64_t operator()(string_view split, uint64_t offset, Emit& emit) const {
+        uint64_t lines = 0;
+        const char* p = split.data();
+        const char* end = p + split.length();
+        while (p < end) {
+            const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!nl) nl = end;
+            emit(string_view(p, nl - p), offset + (p - split.data()));
+            lines++;
+            p = nl + 1;
         }
+        return lines;
     }
-}
+};
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cout << "Usage: ./longestpath <filename>" << endl;
-        return 1;
+template <class Metric>
+struct LongestCombiner {
+    using Local = Longest;
+
+    size_t top_n;
+    bool keep_text;
+    bool histogram;
+
+    Local make_local() const { return Longest(); }
+
+    void operator()(Local& local, string_view text, uint64_t offset) const {
+        uint64_t length = Metric::of(text);
+        if (histogram) {
+            local.histogram.add(text, is_same_v<Metric, ComponentDepth> ? text.length() : length);
+        }
+        vector<Line>& heap = local.heap;
+        if (heap.size() == top_n) {
+            // Most lines lose against the worst kept one and cost nothing more.
+            const Line& worst = heap.front();
+            if (!ranks_before(length, offset, text, worst.length, worst.offset, worst.text)) return;
+            pop_heap(heap.begin(), heap.end(), line_beats);
+            heap.pop_back();
+        }
+        heap.push_back(Line{offset, length, text.length(), keep_text ? string(text) : string()});
+        push_heap(heap.begin(), heap.end(), line_beats);
     }
+};
 
-    string filename = argv[1];
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open file " << filename << endl;
-        return 1;
+struct LongestReducer {
+    using Partial = Longest;
+
+    size_t top_n;
+
+    size_t partitions(size_t) const { return 1; }
+
+    // The result heap comes back sorted, longest first.
+    Partial operator()(size_t, vector<Longest>& locals) const {
+        Longest result;
+        for (auto& local : locals) {
+            result.histogram.merge(local.histogram);
+            for (auto& line : local.heap) result.heap.push_back(std::move(line));
+        }
+        size_t keep = min(top_n, result.heap.size());
+        partial_sort(result.heap.begin(), result.heap.begin() + keep, result.heap.end(), line_beats);
+        result.heap.resize(keep);
+        return result;
     }
+};
+
+//WALK: --walk reads the tree itself instead of a listing. Each task is one directory,
+// listed with getdents64 through a descriptor opened with openat relative to its parent's
+// descriptor, so no full path is resolved again and a rename higher up cannot redirect
+// the walk. Subdirectories are spawned as new tasks sharing their parent's descriptor
+// (closed once the last of them has opened its own); a worker runs its newest task first,
+// so the walk is depth-first and holds about one descriptor per level, while idle workers
+// steal whole subtrees. Running out of descriptors aborts the walk rather than skipping
+// directories. Every entry, the root included, is emitted as a path; the bytes reported
+// are the directory records read.
+struct DirHandle {
+    int fd;
+    explicit DirHandle(int fd) : fd(fd) {}
+    DirHandle(const DirHandle&) = delete;
+    DirHandle& operator=(const DirHandle&) = delete;
+    ~DirHandle() { close(fd); }
+};
 
-    cout << "[Master] Reading file: " << filename << "..." << endl;
-    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
-    
-    long filesize = content.length();
-    if (filesize == 0) {
-        cout << "[Master] Warning: File is empty." << endl;
-        return 0;
+struct WalkTask {
+    shared_ptr<const DirHandle> parent;    // null for the root
+    string path;                           // as reported; the name in parent starts at name_at
+    size_t name_at = 0;
+};
+
+// Pending subdirectories pin their parents' descriptors, one per level of a deep tree and
+// more with several workers: lift the soft limit as far as the hard limit allows.
+inline void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+struct DirWalker {
+    atomic<uint64_t>* unreadable;
+    atomic<int>* exhausted;     // errno of a failed open that was not about the directory
+
+    template <class Spawn, class Emit>
+    pair<uint64_t, uint64_t> operator()(const WalkTask& task, Spawn& spawn, Emit& emit) const {
+        if (*exhausted) return {0, 0};    // the walk is already lost: drain the queue
+        const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+        int fd = task.parent ? openat(task.parent->fd, task.path.c_str() + task.name_at, flags)
+                             : openat(AT_FDCWD, task.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOMEM) *exhausted = errno;
+            else (*unreadable)++;
+            return {0, 0};
+        }
+        auto self = make_shared<const DirHandle>(fd);
+        alignas(8) char buf[32 << 10];
+        string path = task.path;
+        if (path.empty() || path.back() != '/') path += '/';
+        const size_t prefix = path.length();
+        uint64_t bytes = 0, entries = 0;
+        if (!task.parent) {
+            emit(string_view(task.path), uint64_t(0));
+            entries++;
+        }
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+            bytes += n;
+            for (long pos = 0; pos < n;) {
+                // struct linux_dirent64: ino, off, reclen, type, name
+                const char* rec = buf + pos;
+                unsigned short reclen;
+                memcpy(&reclen, rec + 16, sizeof(reclen));
+                unsigned char type = rec[18];
+                const char* name = rec + 19;
+                pos += reclen;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+                path.resize(prefix);
+                path += name;
+                emit(string_view(path), uint64_t(0));
+                entries++;
+                if (type == DT_UNKNOWN) {
+                    struct stat st;
+                    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+                }
+                if (type == DT_DIR) spawn(WalkTask{self, path, prefix});
+            }
+        }
+        if (n < 0) (*unreadable)++;
+        return {bytes, entries};
     }
-    cout << "[Master] File size: " << filesize << " bytes." << endl;
+};
 
-    vector<string> chunks(NUM_THREADS);
-    size_t chunk_size = filesize / NUM_THREADS;
-    
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        if (i == NUM_THREADS - 1) {
-            chunks[i] = content.substr(i * chunk_size);
+// Fetches a winning line's bytes from the input, from the mapping when there is one
+// and with a single pread otherwise.
+template <class Job>
+bool materialize(const Options& opt, const Job& job, Line& line) {
+    if (opt.walk_root) return true;
+    if (!opt.stream) return job.read_input(line.offset, line.bytes, line.text);
+    if (strcmp(opt.filename, "-") == 0 || line.bytes == 0) return true;
+    int fd = open(opt.filename, O_RDONLY);
+    if (fd == -1) return false;
+    line.text.resize(line.bytes);
+    size_t got = 0;
+    while (got < line.bytes) {
+        ssize_t n = pread(fd, &line.text[got], line.bytes - got, line.offset + got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    return got == line.bytes;
+}
+
+// Parses [-j N] [--stream] [--block-size SIZE] [--top N] [--histogram]
+// [--metric bytes|codepoints|depth] [--stats-json FILE] [--workers ADDR,...]
+// <input>... | --walk <root>, or [-j N] --worker ADDR [--root DIR]; -j defaults to the
+// number of hardware threads. An input is a file, a directory or a glob pattern; anything
+// else starting with '-' is refused rather than taken as an input.
+bool parse_args(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--stats-json" && has_value) {
+            opt.stats_json = argv[++i];
+        } else if (arg == "--stream") {
+            opt.stream = true;
+        } else if (arg == "--top" && has_value) {
+            if (!parse_number(argv[++i], opt.top_n)) return false;
+        } else if (arg == "--walk" && has_value) {
+            opt.walk_root = argv[++i];
+        } else if (arg == "--metric" && has_value) {
+            opt.metric = argv[++i];
+            if (opt.metric != "bytes" && opt.metric != "codepoints" && opt.metric != "depth") return false;
+        } else if (arg == "--histogram") {
+            opt.histogram = true;
+        } else if (arg == "--block-size" && has_value) {
+            opt.engine.block_size = parse_size(argv[++i]);
+            if (opt.engine.block_size == 0) return false;
+        } else if (arg == "--worker" && has_value) {
+            opt.worker_addr = argv[++i];
+        } else if (arg == "--root" && has_value) {
+            opt.worker_root = argv[++i];
+        } else if (arg == "--workers" && has_value) {
+            opt.workers = mapreduce::split_list(argv[++i]);
+            if (opt.workers.empty()) return false;
+        } else if (arg == "-j" && has_value) {
+            if (!parse_number(argv[++i], opt.engine.num_threads) || opt.engine.num_threads < 1) return false;
+        } else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2) {
+            if (!parse_number(arg.c_str() + 2, opt.engine.num_threads) || opt.engine.num_threads < 1) return false;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;    // an unknown option, or one missing its value; "-" is stdin
         } else {
-            chunks[i] = content.substr(i * chunk_size, chunk_size);
+            opt.inputs.push_back(argv[i]);
         }
     }
+    if (!opt.worker_addr.empty()) return opt.inputs.empty() && opt.walk_root == nullptr;
+    if (!opt.workers.empty() && (opt.stream || opt.walk_root)) return false;
+    return opt.inputs.empty() != (opt.walk_root == nullptr) && opt.engine.block_size > 0 && opt.top_n > 0;
+}
 
-    cout << "[Master] Launching " << NUM_THREADS << " threads for Map phase..." << endl;
-    vector<thread> threads;
-    vector<string> intermediate_results(NUM_THREADS); 
+void print_histogram(const Histogram& h) {
+    cout << "\n[Master] === PATH LENGTHS ===" << endl;
+    for (size_t i = 0; i < LENGTH_BINS; ++i) {
+        if (!h.lengths[i]) continue;
+        string bin = to_string(i * LENGTH_BIN);
+        bin += (i == LENGTH_BINS - 1) ? "+" : "-" + to_string((i + 1) * LENGTH_BIN - 1);
+        cout << setw(11) << bin << ": " << h.lengths[i] << endl;
+    }
+    cout << "\n[Master] === PATH DEPTHS ===" << endl;
+    for (size_t d = 0; d < h.depths.size(); ++d) {
+        if (h.depths[d]) cout << setw(11) << d << ": " << h.depths[d] << endl;
+    }
+}
 
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        threads.push_back(thread(map_function, ref(chunks[i]), ref(intermediate_results[i])));
+//DISTRIBUTED: a worker runs the job on a byte range and sends back its histogram and its
+// N best lines as positions; the coordinator collects them per worker connection, the
+// usual reducer picks the winners and the text comes from the coordinator's own mapping.
+//   H <length bins...>\n  D <depth counts...>\n   (with histogram=1)
+//   P <offset> <length> <bytes>\n                  (one per line kept)
+void append_numbers(string& out, char tag, const vector<uint64_t>& values) {
+    out += tag;
+    for (uint64_t v : values) out += " " + to_string(v);
+    out += '\n';
+}
+
+template <class Metric>
+string serve_range(const Options& opt, const mapreduce::RangeRequest& request) {
+    size_t top_n = 0;
+    bool histogram = mapreduce::arg_value(request.args, "histogram") == "1";
+    if (!parse_number(mapreduce::arg_value(request.args, "top", "1").c_str(), top_n) || top_n == 0) {
+        return "ERROR bad top";
     }
+    JobStats stats("longestpath", "lines", opt.engine.num_threads);
+    MapReduce job(LineMapper(), LongestCombiner<Metric>{top_n, false, histogram}, LongestReducer{top_n},
+                  opt.engine, stats);
+    if (!job.map_file(request.path.c_str(), request.begin, request.end)) return "ERROR cannot open " + request.path;
+    Longest result = std::move(job.reduce()[0]);
 
-    for (auto& t : threads) {
-        t.join();
+    string reply = "OK\n";
+    if (histogram) {
+        append_numbers(reply, 'H', result.histogram.lengths);
+        append_numbers(reply, 'D', result.histogram.depths);
     }
-    cout << "[Master] Map phase complete." << endl;
+    for (const auto& line : result.heap) {
+        append_numbers(reply, 'P', {line.offset, line.length, line.bytes});
+    }
+    cout << "[Worker] " << request.path << " [" << request.begin << ", " << request.end << ")" << endl;
+    return reply;
+}
 
+string serve(const Options& opt, const mapreduce::RangeRequest& request) {
+    string metric = mapreduce::arg_value(request.args, "metric", "bytes");
+    if (metric == "codepoints") return serve_range<CodepointLength>(opt, request);
+    if (metric == "depth") return serve_range<ComponentDepth>(opt, request);
+    if (metric == "bytes") return serve_range<ByteLength>(opt, request);
+    return "ERROR unknown metric " + metric;
+}
+
+// Folds a worker's reply into one connection's state; returns the lines kept, -1 if malformed.
+int64_t merge_reply(string_view reply, Longest& local) {
+    int64_t lines = 0;
+    size_t pos = 3;     // past "OK\n"
+    while (pos < reply.size()) {
+        size_t nl = reply.find('\n', pos);
+        if (nl == string_view::npos) return -1;
+        vector<uint64_t> values;
+        const char* p = reply.data() + pos + 1;
+        const char* end = reply.data() + nl;
+        while (p < end) {
+            uint64_t v;
+            auto [next, ec] = from_chars(p + 1, end, v);
+            if (ec != errc()) return -1;
+            values.push_back(v);
+            p = next;
+        }
+        Histogram part;
+        switch (reply[pos]) {
+            case 'H':
+                if (values.size() != LENGTH_BINS) return -1;
+                part.lengths = values;
+                local.histogram.merge(part);
+                break;
+            case 'D':
+                part.depths = values;
+                local.histogram.merge(part);
+                break;
+            case 'P':
+                if (values.size() != 3) return -1;
+                local.heap.push_back(Line{values[0], values[1], values[2], string()});
+                lines++;
+                break;
+            default:
+                return -1;
+        }
+        pos = nl + 1;
+    }
+    return lines;
+}
+
+template <class Metric>
+int run(const Options& opt) {
+    // With --workers there is one engine slot per worker connection.
+    mapreduce::Config config = opt.engine;
+    if (!opt.workers.empty()) config.num_threads = opt.workers.size();
+    const size_t num_threads = config.num_threads;
+    JobStats stats("longestpath", opt.walk_root ? "paths" : "lines", num_threads);
+    bool keep_text = opt.walk_root || (opt.stream && strcmp(opt.filename, "-") == 0);
+    MapReduce job(LineMapper(), LongestCombiner<Metric>{opt.top_n, keep_text, opt.histogram},
+                  LongestReducer{opt.top_n}, config, stats);
+    uint64_t skipped = 0;    // --walk: directories left out, which fails the run after reporting
+
+    if (!opt.workers.empty()) {
+        char path[PATH_MAX];
+        if (!realpath(opt.filename, path)) {
+            perror(opt.filename);
+            return 1;
+        }
+        vector<int> connections;
+        for (const auto& addr : opt.workers) {
+            int fd = mapreduce::connect_to(addr);
+            if (fd == -1) {
+                cerr << "Error: cannot connect to worker " << addr << endl;
+                for (int c : connections) close(c);
+                return 1;
+            }
+            connections.push_back(fd);
+        }
+        string args = "metric=" + opt.metric + " top=" + to_string(opt.top_n) +
+                      " histogram=" + (opt.histogram ? "1" : "0");
+        cout << "[Master] Coordinating " << connections.size() << " workers on " << path << "..." << endl;
+        bool mapped = job.map_ranges(path, connections.size() * mapreduce::RANGES_PER_WORKER,
+                                     [&](size_t slot, uint64_t begin, uint64_t end, Longest& local) -> int64_t {
+            string reply;
+            mapreduce::RangeRequest request{path, begin, end, args};
+            if (!mapreduce::send_message(connections[slot], request.encode()) ||
+                !mapreduce::recv_message(connections[slot], reply)) {
+                cerr << "Error: lost worker " << opt.workers[slot] << endl;
+                return -1;
+            }
+            if (reply.compare(0, 3, "OK\n") != 0) {
+                cerr << "Error: worker " << opt.workers[slot] << ": " << reply << endl;
+                return -1;
+            }
+            return merge_reply(reply, local);
+        });
+        for (int c : connections) close(c);
+        if (!mapped) return 1;
+    } else if (opt.walk_root) {
+        struct stat st;
+        if (stat(opt.walk_root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            cerr << "Error: " << opt.walk_root << " is not a directory" << endl;
+            return 1;
+        }
+        cout << "[Master] Walking " << opt.walk_root << " with " << num_threads << " threads..." << endl;
+        atomic<uint64_t> unreadable{0};
+        atomic<int> exhausted{0};
+        raise_fd_limit();
+        job.map_tasks("walk+map", vector<WalkTask>{WalkTask{nullptr, opt.walk_root, 0}},
+                      DirWalker{&unreadable, &exhausted});
+        if (exhausted) {
+            cerr << "Error: walk of " << opt.walk_root << " aborted: " << strerror(exhausted) << endl;
+            return 1;
+        }
+        skipped = unreadable;
+        if (skipped) cout << "[Master] Warning: " << skipped << " directories could not be read." << endl;
+    } else if (opt.inputs.size() > 1) {
+        cout << "[Master] Reading " << opt.inputs.size() << " files..." << endl;
+        cout << "[Master] Launching " << num_threads << " threads for Map phase..." << endl;
+        if (!job.map_files(opt.inputs)) return 1;
+    } else {
+        cout << "[Master] Reading file: " << opt.filename
+             << (opt.stream ? " (streaming)..." : "...") << endl;
+        cout << "[Master] Launching " << num_threads << " threads for Map phase..." << endl;
+        if (!(opt.stream ? job.map_stream(opt.filename) : job.map_file(opt.filename))) {
+            cerr << "Error: Could not read file " << opt.filename << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    }
+    if (!opt.walk_root) {
+        if (job.input_bytes() == 0) {
+            cout << "[Master] Warning: File is empty." << endl;
+            return 0;
+        }
+        cout << "[Master] File size: " << job.input_bytes() << " bytes." << endl;
+    }
+    cout << "[Master] Map phase complete." << endl;
     cout << "[Master] Starting Reduce phase..." << endl;
-    string final_result;
-    reduce_function(intermediate_results, final_result);
+    Longest final_result = std::move(job.reduce()[0]);
+    for (auto& line : final_result.heap) {
+        if (!materialize(opt, job, line)) {
+            cerr << "Error: Could not re-read the result from "
+                 << (opt.inputs.size() > 1 ? "the input" : opt.filename) << endl;
+            return 1;
+        }
+    }
+    stats.finish();
 
     cout << "\n[Master] === RESULT ===" << endl;
-    cout << "Longest Path found: " << final_result << endl;
-    cout << "Length: " << final_result.length() << " characters." << endl;
+    if (opt.top_n == 1) {
+        const Line& longest = final_result.heap.front();
+        cout << "Longest Path found: " << longest.text << endl;
+        cout << "Length: " << longest.length << " " << Metric::unit << "." << endl;
+    } else {
+        cout << "Longest " << final_result.heap.size() << " paths (" << Metric::unit << ", path):" << endl;
+        for (size_t i = 0; i < final_result.heap.size(); ++i) {
+            const Line& line = final_result.heap[i];
+            cout << setw(4) << i + 1 << ". " << setw(6) << line.length << "  " << line.text << endl;
+        }
+    }
+    if (opt.histogram) print_histogram(final_result.histogram);
 
-    return 0;
+    cout << endl;
+    stats.print(cout);
+    if (!opt.stats_json.empty() && !stats.write_json(opt.stats_json)) {
+        cerr << "Warning: could not write " << opt.stats_json << endl;
+    }
+    return skipped ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        cout << "Usage: ./longestpath [-j threads] [--stream [--block-size SIZE]] [--top N] [--histogram] "
+                "[--metric bytes|codepoints|depth] [--stats-json FILE] [--workers ADDR,...] "
+                "<file | dir | 'glob'>... | --walk root\n"
+                "       ./longestpath [-j threads] --worker ADDR [--root DIR]\n"
+                "         (ADDR: host:port or unix:/path; DIR: the tree served, default .)" << endl;
+        return 1;
+    }
+    // every allocation pays an atomic add while counting, so only count when asked to
+    mapreduce::allocation_counting = !opt.stats_json.empty();
+    if (!opt.worker_addr.empty()) {
+        cout << "[Worker] Serving map tasks on " << opt.worker_addr << " with "
+             << opt.engine.num_threads << " threads..." << endl;
+        return mapreduce::serve(opt.worker_addr, opt.worker_root,
+                                [&](const mapreduce::RangeRequest& request) { return serve(opt, request); });
+    }
+    if (!opt.walk_root) {
+        vector<string> paths;
+        if (!mapreduce::expand_inputs(opt.inputs, paths)) return 1;
+        if (paths.empty()) {
+            cerr << "Error: no input files" << endl;
+            return 1;
+        }
+        opt.inputs = std::move(paths);
+        opt.filename = opt.inputs[0].c_str();
+        if (opt.inputs.size() > 1 && (opt.stream || !opt.workers.empty())) {
+            cerr << "Error: --stream and --workers take a single input file" << endl;
+            return 1;
+        }
+    }
+    if (opt.metric == "codepoints") return run<CodepointLength>(opt);
+    if (opt.metric == "depth") return run<ComponentDepth>(opt);
+    return run<ByteLength>(opt);
 }
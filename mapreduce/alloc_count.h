@@ -0,0 +1,35 @@
+// Counting replacements for the global allocation functions, feeding the allocation
+// figures of JobStats while mapreduce::allocation_counting is on. Include it from
+// exactly one translation unit per program (the driver's main file); the engine
+// headers do not pull it in.
+#ifndef MAPREDUCE_ALLOC_COUNT_H
+#define MAPREDUCE_ALLOC_COUNT_H
+
+#include <cstdlib>
+#include <new>
+#include "stats.h"
+
+// The array and nothrow forms forward to these by default. GCC flags the malloc/free
+// pairing inside them, but that pairing is exactly what a replacement is allowed to do.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    if (mapreduce::allocation_counting.load(std::memory_order_relaxed)) {
+        mapreduce::allocation_count.fetch_add(1, std::memory_order_relaxed);
+        mapreduce::allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
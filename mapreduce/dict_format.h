@@ -0,0 +1,190 @@
+// Binary format for partial dictionaries (word -> count), used for spill runs and for
+// the replies of distributed workers.
+//
+//   header   "MRDICT" version:u8 flags:u8           (version 1, flags 0)
+//   entry    shared:varint suffix_len:varint suffix[suffix_len] count:varint
+//   end      0 0 0                                  (an empty entry with count 0)
+//
+// Keys are strictly increasing, each stored as the length of the prefix it shares with
+// the previous key plus the rest (front coding); varints are LEB128. Counts are >= 1,
+// which keeps the end marker unambiguous and lets readers tell a complete dictionary
+// from a truncated one. Since entries are sorted, dictionaries merge in one streaming
+// pass, reading each straight out of a memory mapping.
+#ifndef MAPREDUCE_DICT_FORMAT_H
+#define MAPREDUCE_DICT_FORMAT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "mapreduce.h"
+
+namespace mapreduce {
+
+const char DICT_MAGIC[6] = {'M', 'R', 'D', 'I', 'C', 'T'};
+const uint8_t DICT_VERSION = 1;
+const size_t DICT_HEADER_SIZE = sizeof(DICT_MAGIC) + 2;
+
+inline void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += char(v | 0x80);
+        v >>= 7;
+    }
+    out += char(v);
+}
+
+// Reads a varint at p (< end) and advances p; false if it is truncated or too long.
+inline bool get_varint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        v |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Writes one dictionary, either appended to a string or to a file through a 1 MB buffer.
+class DictWriter {
+public:
+    explicit DictWriter(std::string& out) : out(out) { start(); }
+
+    explicit DictWriter(const char* path) : out(own), f(fopen(path, "wb")) { start(); }
+
+    DictWriter(const DictWriter&) = delete;
+    DictWriter& operator=(const DictWriter&) = delete;
+
+    ~DictWriter() {
+        if (f) fclose(f);
+    }
+
+    bool ok() const { return f != nullptr || &out != &own; }
+
+    // Keys must come in strictly increasing order, counts must be >= 1.
+    void add(std::string_view key, uint64_t count) {
+        size_t shared = 0, limit = std::min(key.size(), previous.size());
+        while (shared < limit && key[shared] == previous[shared]) shared++;
+        put_varint(out, shared);
+        put_varint(out, key.size() - shared);
+        out.append(key.data() + shared, key.size() - shared);
+        put_varint(out, count);
+        previous.assign(key.data(), key.size());
+        if (f && out.size() >= (1 << 20)) flush();
+    }
+
+    // Writes the end marker; for files also flushes and closes, and with `durable` waits
+    // until the data is on disk. False on I/O errors.
+    bool finish(bool durable = false) {
+        put_varint(out, 0);
+        put_varint(out, 0);
+        put_varint(out, 0);
+        if (&out == &own) {
+            if (!f) return false;
+            flush();
+            if (durable && (fflush(f) != 0 || fsync(fileno(f)) != 0)) failed = true;
+            bool closed = fclose(f) == 0;
+            f = nullptr;
+            return closed && !failed;
+        }
+        return true;
+    }
+
+private:
+    void start() {
+        out.append(DICT_MAGIC, sizeof(DICT_MAGIC));
+        out += char(DICT_VERSION);
+        out += char(0);
+    }
+
+    void flush() {
+        if (fwrite(out.data(), 1, out.size(), f) != out.size()) failed = true;
+        out.clear();
+    }
+
+    std::string own;
+    std::string& out;
+    FILE* f = nullptr;
+    bool failed = false;
+    std::string previous;
+};
+
+// Iterates over a dictionary held in memory (a string, a received message or a mapping).
+// key() stays valid until the next call to next().
+class DictReader {
+public:
+    DictReader() = default;
+
+    explicit DictReader(std::string_view data) : p(data.data()), end(data.data() + data.size()) {
+        valid = data.size() >= DICT_HEADER_SIZE && memcmp(p, DICT_MAGIC, sizeof(DICT_MAGIC)) == 0 &&
+                uint8_t(p[sizeof(DICT_MAGIC)]) == DICT_VERSION && p[sizeof(DICT_MAGIC) + 1] == 0;
+        p += valid ? DICT_HEADER_SIZE : 0;
+    }
+
+    // Advances to the next entry; false at the end marker or on malformed input, which
+    // includes a key not above the previous one and a zero count.
+    bool next() {
+        if (!valid || done) return false;
+        uint64_t shared, suffix;
+        if (!get_varint(p, end, shared) || !get_varint(p, end, suffix) ||
+            shared > current.size() || suffix > uint64_t(end - p)) {
+            valid = false;
+            return false;
+        }
+        // both keys start with current[0, shared), so their order is that of what follows
+        std::string_view rest(p, suffix);
+        bool ascending = !started || std::string_view(current).substr(shared) < rest;
+        current.resize(shared);
+        current.append(p, suffix);
+        p += suffix;
+        if (!get_varint(p, end, value)) {
+            valid = false;
+            return false;
+        }
+        if (shared == 0 && suffix == 0 && value == 0) {
+            done = true;
+            return false;
+        }
+        if (!ascending || value == 0) {
+            valid = false;
+            return false;
+        }
+        started = true;
+        return true;
+    }
+
+    std::string_view key() const { return current; }
+    uint64_t count() const { return value; }
+
+    // True once the end marker has been read: the dictionary was neither cut nor corrupt.
+    bool complete() const { return valid && done; }
+
+private:
+    const char* p = nullptr;
+    const char* end = nullptr;
+    bool valid = false;
+    bool done = false;
+    bool started = false;     // an entry has been read, so keys must now increase
+    std::string current;
+    uint64_t value = 0;
+};
+
+// A dictionary file read through a read-only mapping.
+class DictFile {
+public:
+    bool open(const std::string& path) {
+        if (!file.open(path.c_str())) return false;
+        reader = DictReader(file.view());
+        return true;
+    }
+
+    DictReader reader;
+
+private:
+    MappedFile file;
+};
+
+} // namespace mapreduce
+
+#endif
@@ -0,0 +1,737 @@
+// Header-only MapReduce engine shared by the Practical drivers (wordcount, longestpath).
+//
+// A job is three policy objects, all called directly (and so inlined) by the engine:
+//
+//   Mapper    static bool is_boundary(unsigned char c);
+//                 Splits and stream blocks are only ever cut right after such a byte.
+//             template <class Emit>
+//             uint64_t operator()(std::string_view split, uint64_t offset, Emit& emit) const;
+//                 Calls emit(record...) for every intermediate record of the split, which
+//                 starts at byte `offset` of the input (for map_files(), of all the files
+//                 laid end to end). Returns the number of items seen.
+//                 (map_tasks() has no input to split and takes a visitor instead.)
+//
+//   Combiner  using Local = ...;             per-worker state, movable
+//             Local make_local() const;
+//             void operator()(Local& local, record...) const;
+//                 Folds one record into the worker's state: the local aggregation that
+//                 happens before the shuffle.
+//             void after_split(Local& local, size_t split) const;    (optional)
+//                 Called after each split (split = its index) or stream block (its
+//                 sequence number), e.g. to spill when over a memory budget.
+//
+//   Reducer   using Partial = ...;           default-constructible
+//             size_t partitions(size_t num_threads) const;
+//             Partial operator()(size_t partition, std::vector<Local>& locals) const;
+//                 Reduces one partition over every worker's state; partitions run in
+//                 parallel on the same pool as the mappers.
+//
+// The engine owns the input mapping and the worker states, so partials may keep
+// pointers into either for as long as the engine lives (except into the small files of
+// map_files(), which are unmapped as soon as they have been mapped).
+#ifndef MAPREDUCE_MAPREDUCE_H
+#define MAPREDUCE_MAPREDUCE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+namespace mapreduce {
+
+struct Config {
+    size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t split_size = 4 << 20;
+    size_t splits_per_thread = 8;      // at least this many splits per thread, for stealing
+    size_t block_size = 4 << 20;       // streaming mode
+    size_t num_splits = 0;             // map_file/map_files: 0 derives it from num_threads and split_size
+
+    size_t splits_for(uint64_t bytes) const {
+        return num_splits ? num_splits : std::max(num_threads * splits_per_thread, size_t(bytes / split_size));
+    }
+};
+
+// Accepts sizes such as 512K, 64M or 2G; a bare number is taken as megabytes. Anything
+// else, and sizes under a byte, give 0, which no caller accepts.
+inline size_t parse_size(const char* text) {
+    char* end;
+    double value = std::strtod(text, &end);
+    if (end == text) return 0;
+    double unit = 1 << 20;
+    switch (std::toupper((unsigned char)*end)) {
+        case 'K': unit = 1 << 10; ++end; break;
+        case 'M': ++end; break;
+        case 'G': unit = 1 << 30; ++end; break;
+    }
+    double bytes = value * unit;
+    if (*end != '\0' || !(bytes >= 1 && bytes < 0x1p63)) return 0;
+    return bytes;
+}
+
+// Parses the whole of text as a decimal number; false on an empty value, trailing text,
+// a sign on an unsigned type or a value out of range. Callers check the bounds.
+template <class T>
+bool parse_number(const char* text, T& out) {
+    static_assert(std::is_integral<T>::value, "integral types only");
+    const char* end = text + std::strlen(text);
+    auto [next, ec] = std::from_chars(text, end, out);
+    return ec == std::errc() && next == end;
+}
+
+inline bool parse_number(const char* text, double& out) {
+    char* end;
+    errno = 0;
+    out = std::strtod(text, &end);
+    return end != text && *end == '\0' && errno == 0;
+}
+
+//INPUT: the file is mapped read-only and mappers only ever see string_view slices of it
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (mapped) munmap(const_cast<char*>(data), size);
+    }
+
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+                mapped = true;
+                ::close(fd);
+                return true;
+            }
+        }
+        ::close(fd);
+
+        // pipes, empty files and /proc entries cannot be mapped, read them the old way
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return false;
+        fallback.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = fallback.data();
+        size = fallback.size();
+        return true;
+    }
+
+    std::string_view view() const { return std::string_view(data, size); }
+    bool is_mapped() const { return mapped; }
+
+    // Drop already-consumed pages from our RSS, the kernel can re-read them if needed.
+    void release(std::string_view consumed) const {
+        if (!mapped || consumed.empty()) return;
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(consumed.data()) + page - 1) & ~(page - 1);
+        uintptr_t end = (reinterpret_cast<uintptr_t>(consumed.data()) + consumed.size()) & ~(page - 1);
+        if (end > begin) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+
+private:
+    const char* data = "";
+    size_t size = 0;
+    bool mapped = false;
+    std::string fallback;
+};
+
+//SPLIT: every cut is pushed forward to just after the next boundary byte, so no record
+// straddles two chunks and the result does not depend on the number of chunks.
+template <class IsBoundary>
+std::vector<std::string_view> split_at_boundaries(std::string_view content, size_t num_chunks,
+                                                  IsBoundary is_boundary) {
+    std::vector<std::string_view> chunks;
+    size_t chunk_size = content.length() / num_chunks;
+    size_t start = 0;
+    for (size_t i = 0; i < num_chunks; ++i) {
+        size_t end = content.length();
+        if (i != num_chunks - 1) {
+            end = std::max(start, (i + 1) * chunk_size);
+            while (end < content.length() && !is_boundary((unsigned char)content[end])) end++;
+            end = std::min(end + 1, content.length());
+        }
+        chunks.push_back(content.substr(start, end - start));
+        start = end;
+    }
+    return chunks;
+}
+
+inline std::vector<size_t> split_ids(size_t count) {
+    std::vector<size_t> ids(count);
+    for (size_t i = 0; i < count; ++i) ids[i] = i;
+    return ids;
+}
+
+//INPUTS: an input argument is a file, a directory (every regular file below it, in name
+// order) or a glob pattern. Patterns are expanded here so that a quoted "shards/*" does
+// not run into the shell's argument length limit.
+inline bool has_glob_chars(const std::string& arg) { return arg.find_first_of("*?[") != std::string::npos; }
+
+inline bool list_directory(const std::string& dir, std::vector<std::string>& paths) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    std::vector<std::string> names;
+    while (dirent* entry = readdir(d)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    bool ok = true;
+    for (const auto& name : names) {
+        std::string path = dir + "/" + name;
+        struct stat st, lst;
+        if (stat(path.c_str(), &st) != 0) continue;
+        if (S_ISREG(st.st_mode)) {
+            paths.push_back(path);
+        } else if (S_ISDIR(st.st_mode) && lstat(path.c_str(), &lst) == 0 && !S_ISLNK(lst.st_mode)) {
+            ok = list_directory(path, paths) && ok;    // symlinked directories could loop
+        }
+    }
+    return ok;
+}
+
+// Appends the files each argument names; false (with a message) if one names nothing.
+inline bool expand_inputs(const std::vector<std::string>& args, std::vector<std::string>& paths) {
+    for (const auto& arg : args) {
+        struct stat st;
+        if (stat(arg.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            std::string dir = arg.size() > 1 && arg.back() == '/' ? arg.substr(0, arg.size() - 1) : arg;
+            if (!list_directory(dir, paths)) fprintf(stderr, "Warning: could not read all of %s\n", arg.c_str());
+        } else if (has_glob_chars(arg) && stat(arg.c_str(), &st) != 0) {
+            glob_t matches;
+            if (glob(arg.c_str(), 0, nullptr, &matches) != 0) {
+                fprintf(stderr, "Error: no input matches %s\n", arg.c_str());
+                return false;
+            }
+            for (size_t i = 0; i < matches.gl_pathc; ++i) {
+                if (stat(matches.gl_pathv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+                    list_directory(matches.gl_pathv[i], paths);
+                } else {
+                    paths.push_back(matches.gl_pathv[i]);
+                }
+            }
+            globfree(&matches);
+        } else {
+            paths.push_back(arg);    // "-" and missing files are reported by whoever opens them
+        }
+    }
+    return true;
+}
+
+// One file of a map_files() job; `base` is where it starts in the concatenated input.
+struct InputFile {
+    std::string path;
+    uint64_t base = 0;
+    uint64_t size = 0;
+};
+
+//TASK POOL: every worker owns a deque, takes its newest task from the back and steals the oldest
+// from the front of the others, so work a task spawns runs depth-first on its worker while
+// thieves take the biggest pieces; a worker that finds nothing to take sleeps until a task is
+// queued or the run is over
+template <class Task>
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t num_workers) : queues(num_workers) {}
+
+    // Also callable from inside a running task to queue follow-up work on that worker.
+    void push(size_t worker, Task task) {
+        pending++;
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].m);
+            queues[worker].tasks.push_back(std::move(task));
+        }
+        queued++;
+        wake_one();
+    }
+
+    // Seeds each worker with a contiguous run of tasks, then calls f(task, worker) until none are left.
+    // Seeded back to front, so each worker still takes its own run in ascending order.
+    template <class F>
+    void run(std::vector<Task> tasks, F f) {
+        for (size_t i = tasks.size(); i-- > 0;) {
+            push(i * queues.size() / tasks.size(), std::move(tasks[i]));
+        }
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < queues.size(); ++w) {
+            threads.push_back(std::thread([this, w, &f] { work(w, f); }));
+        }
+        for (auto& t : threads) t.join();
+    }
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(size_t w, Task& out) {
+        std::lock_guard<std::mutex> lock(queues[w].m);
+        if (queues[w].tasks.empty()) return false;
+        out = std::move(queues[w].tasks.back());
+        queues[w].tasks.pop_back();
+        queued--;
+        return true;
+    }
+
+    bool steal(size_t w, Task& out) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue& victim = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (victim.tasks.empty()) continue;
+            out = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    // Taking idle_m before notifying closes the gap between a sleeper's check and its wait.
+    void wake_one() {
+        { std::lock_guard<std::mutex> lock(idle_m); }
+        wake.notify_one();
+    }
+
+    void wake_all() {
+        { std::lock_guard<std::mutex> lock(idle_m); }
+        wake.notify_all();
+    }
+
+    template <class F>
+    void work(size_t w, F& f) {
+        Task task;
+        while (true) {
+            if (pop(w, task) || steal(w, task)) {
+                f(task, w);
+                if (--pending == 0) wake_all();     // the last task ends the run for everyone
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_m);
+            wake.wait(lock, [&] { return queued.load() > 0 || pending.load() == 0; });
+            if (pending.load() == 0) return;
+        }
+    }
+
+    std::vector<Queue> queues;
+    std::atomic<size_t> pending{0};     // queued or running
+    std::atomic<size_t> queued{0};      // sitting in a deque
+    std::mutex idle_m;
+    std::condition_variable wake;
+};
+
+//STREAMING: reader -> bounded block queue -> mappers, for inputs that do not fit in memory
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        not_full.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // Blocks until an item is available; returns false once the queue is closed and drained.
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        out = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable not_full, not_empty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+struct Block {
+    std::string data;
+    uint64_t offset = 0;    // position of data[0] in the input
+    size_t index = 0;       // sequence number
+};
+
+// Reads block_size bytes at a time and cuts each block after its last boundary byte;
+// the unfinished record is carried into the next block. A block without any boundary
+// keeps growing until one shows up, so records are never split. Returns bytes read;
+// error is set to the errno of a failed read() (which ends the input), 0 otherwise.
+template <class IsBoundary>
+uint64_t read_blocks(int fd, size_t block_size, BoundedQueue<Block>& queue, IsBoundary is_boundary,
+                     int& error) {
+    error = 0;
+    uint64_t total = 0, offset = 0;
+    size_t index = 0;
+    std::string carry;
+    while (true) {
+        Block block;
+        block.data = std::move(carry);
+        block.offset = offset;
+        block.index = index;
+        carry.clear();
+        size_t have = block.data.size();
+        block.data.resize(have + block_size);
+        size_t got = 0;
+        while (got < block_size) {
+            ssize_t n = read(fd, &block.data[have + got], block_size - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) error = errno;
+            if (n <= 0) break;
+            got += n;
+        }
+        block.data.resize(have + got);
+        total += got;
+        if (error != 0) break;     // a truncated input must not pass for a complete one
+        if (got == 0) {
+            if (!block.data.empty()) queue.push(std::move(block));
+            break;
+        }
+
+        size_t cut = block.data.size();
+        while (cut > 0 && !is_boundary((unsigned char)block.data[cut - 1])) cut--;
+        if (cut == 0) {
+            carry = std::move(block.data);
+            continue;
+        }
+        carry.assign(block.data, cut, std::string::npos);
+        block.data.resize(cut);
+        offset += cut;
+        index++;
+        queue.push(std::move(block));
+    }
+    queue.close();
+    return total;
+}
+
+template <class C, class L, class = void>
+struct has_after_split : std::false_type {};
+
+template <class C, class L>
+struct has_after_split<C, L, std::void_t<decltype(std::declval<const C&>().after_split(std::declval<L&>(), size_t()))>>
+    : std::true_type {};
+
+//ENGINE
+template <class Mapper, class Combiner, class Reducer>
+class MapReduce {
+public:
+    using Local = typename Combiner::Local;
+    using Partial = typename Reducer::Partial;
+
+    MapReduce(Mapper mapper, Combiner combiner, Reducer reducer, const Config& config, JobStats& stats)
+        : mapper(std::move(mapper)), combiner(std::move(combiner)), reducer(std::move(reducer)),
+          config(config), stats(stats), pool(config.num_threads) {
+        local_states.reserve(config.num_threads);
+        for (size_t w = 0; w < config.num_threads; ++w) local_states.push_back(this->combiner.make_local());
+    }
+
+    // Map phase over a file mapped in memory, cut into many boundary-aligned splits.
+    // [begin, end) restricts it to a byte range that starts and ends on record boundaries.
+    bool map_file(const char* path, uint64_t begin = 0, uint64_t end = UINT64_MAX) {
+        stats.phase("read");
+        if (!input.open(path)) return false;
+        std::string_view whole = input.view();
+        begin = std::min<uint64_t>(begin, whole.size());
+        std::string_view content = whole.substr(begin, std::min<uint64_t>(end, whole.size()) - begin);
+        input_size = content.size();
+        stats.set_input_bytes(input_size);
+
+        stats.phase("split");
+        std::vector<std::string_view> splits =
+            split_at_boundaries(content, config.splits_for(content.size()), Mapper::is_boundary);
+        std::vector<size_t> todo;
+        for (size_t i = 0; i < splits.size(); ++i) {
+            if (i >= done_splits.size() || !done_splits[i]) todo.push_back(i);
+        }
+
+        stats.phase("map");
+        pool.run(std::move(todo), [&](size_t split, size_t worker) {
+            map_split(splits[split], splits[split].data() - whole.data(), split, worker);
+            input.release(splits[split]);
+        });
+        return true;
+    }
+
+    // Map phase over many files as one input. Files are laid end to end (offsets passed to
+    // the mapper are into that concatenation) and cut into tasks of about the same size:
+    // a file bigger than that is mapped here and split at boundaries, runs of smaller
+    // files are batched into one task that maps each of them in turn. A record never
+    // spans two files. Small files are unmapped after their task; use read_input() to get
+    // bytes back once the job is done.
+    bool map_files(const std::vector<std::string>& paths) {
+        stats.phase("read");
+        files.clear();
+        file_maps.clear();
+        uint64_t total = 0;
+        for (const auto& path : paths) {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "Error: cannot read %s\n", path.c_str());
+                return false;
+            }
+            files.push_back(InputFile{path, total, uint64_t(st.st_size)});
+            total += st.st_size;
+        }
+        file_maps.resize(files.size());
+        input_size = total;
+        stats.set_input_bytes(input_size);
+
+        stats.phase("split");
+        const uint64_t target = std::max<uint64_t>(total / config.splits_for(total), 1);
+        struct Task {
+            size_t first, last;           // files [first, last) ...
+            std::string_view piece;       // ... or this piece of files[first] when it is big
+        };
+        std::vector<Task> tasks;
+        uint64_t batched = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].size <= target) {
+                if (batched == 0) tasks.push_back(Task{i, i + 1, {}});
+                tasks.back().last = i + 1;
+                batched += files[i].size;
+                if (batched >= target) batched = 0;
+                continue;
+            }
+            batched = 0;
+            file_maps[i] = std::make_unique<MappedFile>();
+            if (!file_maps[i]->open(files[i].path.c_str())) {
+                fprintf(stderr, "Error: cannot read %s\n", files[i].path.c_str());
+                return false;
+            }
+            std::string_view content = file_maps[i]->view().substr(0, files[i].size);
+            size_t pieces = (files[i].size + target - 1) / target;
+            for (std::string_view piece : split_at_boundaries(content, pieces, Mapper::is_boundary)) {
+                if (!piece.empty()) tasks.push_back(Task{i, i + 1, piece});
+            }
+        }
+
+        stats.phase("map");
+        std::atomic<bool> failed{false};
+        pool.run(split_ids(tasks.size()), [&](size_t t, size_t worker) {
+            const Task& task = tasks[t];
+            if (!task.piece.empty()) {
+                const MappedFile& mapped = *file_maps[task.first];
+                map_split(task.piece, files[task.first].base + (task.piece.data() - mapped.view().data()), t, worker);
+                mapped.release(task.piece);
+                return;
+            }
+            double start = now_seconds();
+            uint64_t bytes = 0, items = 0;
+            for (size_t i = task.first; i < task.last; ++i) {
+                if (files[i].size == 0) continue;
+                MappedFile mapped;
+                if (!mapped.open(files[i].path.c_str())) {
+                    fprintf(stderr, "Error: cannot read %s\n", files[i].path.c_str());
+                    failed = true;
+                    continue;
+                }
+                items += map_records(mapped.view().substr(0, files[i].size), files[i].base, worker);
+                bytes += files[i].size;
+            }
+            if constexpr (has_after_split<Combiner, Local>::value) combiner.after_split(local_states[worker], t);
+            stats.record_split(worker, now_seconds() - start, bytes, items);
+        });
+        return !failed;
+    }
+
+    // Copies `length` input bytes at `offset`, as passed to the mapper, into out.
+    bool read_input(uint64_t offset, size_t length, std::string& out) const {
+        if (files.empty()) {
+            out.assign(input.view().substr(offset, length));
+            return true;
+        }
+        auto next = std::upper_bound(files.begin(), files.end(), offset,
+                                     [](uint64_t o, const InputFile& f) { return o < f.base; });
+        size_t i = next - files.begin() - 1;
+        uint64_t local = offset - files[i].base;
+        if (file_maps[i]) {
+            out.assign(file_maps[i]->view().substr(local, length));
+            return true;
+        }
+        int fd = open(files[i].path.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        out.resize(length);
+        size_t got = 0;
+        while (got < length) {
+            ssize_t n = pread(fd, &out[got], length - got, local + got);
+            if (n <= 0) break;
+            got += n;
+        }
+        close(fd);
+        return got == length;
+    }
+
+    // Splits of the next map_file() to leave out, e.g. because a checkpoint already has
+    // their results. Only meaningful with a fixed Config::num_splits.
+    void skip_splits(std::vector<bool> done) { done_splits = std::move(done); }
+
+    // Map phase fed block by block from a reader thread ("-" reads stdin); memory stays
+    // bounded by (queue depth + threads) * block size plus whatever the combiner keeps.
+    // Returns false with errno set if the input cannot be opened or a read fails.
+    bool map_stream(const char* path) {
+        int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+        if (fd == -1) return false;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Reading overlaps with mapping here, so both are timed as one phase.
+        stats.phase("read+map");
+        BoundedQueue<Block> queue(config.num_threads);
+        std::vector<std::thread> mappers;
+        for (size_t w = 0; w < config.num_threads; ++w) {
+            mappers.push_back(std::thread([&, w] {
+                Block block;
+                while (queue.pop(block)) map_split(block.data, block.offset, block.index, w);
+            }));
+        }
+        int error;
+        input_size = read_blocks(fd, config.block_size, queue, Mapper::is_boundary, error);
+        for (auto& t : mappers) t.join();
+        if (fd != STDIN_FILENO) close(fd);
+        stats.set_input_bytes(input_size);
+        errno = error;
+        return error == 0;
+    }
+
+    // Map phase run by remote workers: the file is mapped here only to find the cuts (and
+    // to look results up later), then fetch(slot, begin, end, local) is called for each of
+    // num_ranges boundary-aligned ranges, from one thread per config.num_threads slot
+    // (e.g. one per worker connection), and folds the remote result into the slot's
+    // Local. fetch returns the number of items, or -1 to fail the job.
+    template <class Fetch>
+    bool map_ranges(const char* path, size_t num_ranges, Fetch fetch) {
+        stats.phase("read");
+        if (!input.open(path)) return false;
+        std::string_view content = input.view();
+        input_size = content.size();
+        stats.set_input_bytes(input_size);
+
+        stats.phase("split");
+        std::vector<std::string_view> ranges = split_at_boundaries(content, num_ranges, Mapper::is_boundary);
+
+        stats.phase("map");
+        std::atomic<bool> failed{false};
+        pool.run(split_ids(ranges.size()), [&](size_t range, size_t slot) {
+            if (failed || ranges[range].empty()) return;
+            double start = now_seconds();
+            uint64_t begin = ranges[range].data() - content.data();
+            int64_t items = fetch(slot, begin, begin + ranges[range].size(), local_states[slot]);
+            if (items < 0) {
+                failed = true;
+                return;
+            }
+            stats.record_split(slot, now_seconds() - start, ranges[range].size(), items);
+        });
+        return !failed;
+    }
+
+    // Map phase over work that is discovered as it goes (e.g. a directory tree): the pool
+    // is seeded with `roots` and visit(task, spawn, emit) may spawn(follow-up task) onto
+    // its own worker's queue, where idle workers can steal it. visit returns the
+    // {bytes read, items emitted} of its task.
+    template <class Task, class Visit>
+    void map_tasks(const char* phase, std::vector<Task> roots, Visit visit) {
+        stats.phase(phase);
+        std::atomic<uint64_t> total{0};
+        WorkStealingPool<Task> tasks(config.num_threads);
+        tasks.run(std::move(roots), [&](Task& task, size_t worker) {
+            double start = now_seconds();
+            Local& local = local_states[worker];
+            auto emit = [&](auto&&... record) { combiner(local, std::forward<decltype(record)>(record)...); };
+            auto spawn = [&](Task next) { tasks.push(worker, std::move(next)); };
+            std::pair<uint64_t, uint64_t> done = visit(task, spawn, emit);
+            total += done.first;
+            stats.record_split(worker, now_seconds() - start, done.first, done.second);
+        });
+        input_size = total;
+        stats.set_input_bytes(input_size);
+    }
+
+    // Reduce phase: one Partial per partition, computed in parallel.
+    std::vector<Partial> reduce() {
+        stats.phase("reduce");
+        std::vector<Partial> partials(reducer.partitions(config.num_threads));
+        pool.run(split_ids(partials.size()), [&](size_t partition, size_t) {
+            partials[partition] = reducer(partition, local_states);
+        });
+        return partials;
+    }
+
+    std::vector<Local>& locals() { return local_states; }
+    const MappedFile& mapped_input() const { return input; }
+    const std::vector<InputFile>& input_files() const { return files; }
+    size_t num_threads() const { return config.num_threads; }
+    uint64_t input_bytes() const { return input_size; }
+
+private:
+    uint64_t map_records(std::string_view split, uint64_t offset, size_t worker) {
+        Local& local = local_states[worker];
+        auto emit = [&](auto&&... record) { combiner(local, std::forward<decltype(record)>(record)...); };
+        return mapper(split, offset, emit);
+    }
+
+    void map_split(std::string_view split, uint64_t offset, size_t index, size_t worker) {
+        double start = now_seconds();
+        uint64_t items = map_records(split, offset, worker);
+        if constexpr (has_after_split<Combiner, Local>::value) combiner.after_split(local_states[worker], index);
+        stats.record_split(worker, now_seconds() - start, split.size(), items);
+    }
+
+    Mapper mapper;
+    Combiner combiner;
+    Reducer reducer;
+    Config config;
+    JobStats& stats;
+    WorkStealingPool<size_t> pool;
+    MappedFile input;
+    std::vector<InputFile> files;                       // map_files()
+    std::vector<std::unique_ptr<MappedFile>> file_maps; // kept for the files that were split
+    uint64_t input_size = 0;
+    std::vector<bool> done_splits;
+    std::vector<Local> local_states;
+};
+
+} // namespace mapreduce
+
+#endif
@@ -0,0 +1,255 @@
+// Coordinator/worker transport for the MapReduce drivers.
+//
+// Messages use the Midterm v3 framing: a 4-byte big-endian length, then the payload.
+// Addresses are "host:port" for TCP or "unix:/path/to/socket" for a UNIX socket.
+//
+// A job is a sequence of request/reply pairs on one connection per worker:
+//   request  RangeRequest::encode(): input path, byte range, tool-specific arguments
+//   reply    "OK\n" + serialized partial result, or "ERROR <reason>"
+// The connection is closed by the coordinator when it has no ranges left. Workers read
+// the input themselves, so the path must name the same file on every machine. Requests
+// are not authenticated: a worker only opens files under the root directory it was
+// started with, so it never serves more than that tree.
+#ifndef MAPREDUCE_NET_H
+#define MAPREDUCE_NET_H
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace mapreduce {
+
+const size_t MAX_MESSAGE = 1u << 30;
+const size_t RANGES_PER_WORKER = 4;    // more ranges than workers, so fast workers take more
+
+inline bool send_all(int sock, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int sock, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+inline bool send_message(int sock, std::string_view msg) {
+    uint32_t net_len = htonl((uint32_t)msg.size());
+    return msg.size() <= MAX_MESSAGE && send_all(sock, &net_len, sizeof(net_len)) &&
+           send_all(sock, msg.data(), msg.size());
+}
+
+// Fails on a closed connection and on messages longer than max_len.
+inline bool recv_message(int sock, std::string& msg, size_t max_len = MAX_MESSAGE) {
+    uint32_t net_len;
+    if (!recv_all(sock, &net_len, sizeof(net_len))) return false;
+    uint32_t len = ntohl(net_len);
+    if (len > max_len) return false;
+    msg.resize(len);
+    return recv_all(sock, msg.data(), len);
+}
+
+// Fills a sockaddr for `addr`; returns its length, or 0 if the address is malformed.
+inline socklen_t resolve(const std::string& addr, sockaddr_storage& out) {
+    memset(&out, 0, sizeof(out));
+    if (addr.compare(0, 5, "unix:") == 0) {
+        sockaddr_un& un = reinterpret_cast<sockaddr_un&>(out);
+        std::string path = addr.substr(5);
+        if (path.empty() || path.size() >= sizeof(un.sun_path)) return 0;
+        un.sun_family = AF_UNIX;
+        memcpy(un.sun_path, path.c_str(), path.size() + 1);
+        return sizeof(sockaddr_un);
+    }
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) return 0;
+    std::string host = addr.substr(0, colon), port = addr.substr(colon + 1);
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) return 0;
+    socklen_t len = res->ai_addrlen;
+    memcpy(&out, res->ai_addr, len);
+    freeaddrinfo(res);
+    return len;
+}
+
+// Length and payload go out as separate sends; without this Nagle holds the second one
+// back until the peer's delayed ACK, about 40 ms per request.
+inline void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+inline int connect_to(const std::string& addr) {
+    sockaddr_storage sa;
+    socklen_t len = resolve(addr, sa);
+    if (len == 0) return -1;
+    int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&sa), len) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (sa.ss_family == AF_INET) set_nodelay(fd);
+    return fd;
+}
+
+inline int listen_on(const std::string& addr) {
+    sockaddr_storage sa;
+    socklen_t len = resolve(addr, sa);
+    if (len == 0) return -1;
+    int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (sa.ss_family == AF_UNIX) {
+        unlink(reinterpret_cast<sockaddr_un&>(sa).sun_path);
+    } else {
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&sa), len) == -1 || listen(fd, 16) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One map task for a worker: bytes [begin, end) of `path`, both on record boundaries.
+struct RangeRequest {
+    std::string path;
+    uint64_t begin = 0, end = 0;
+    std::string args;       // tool-specific, e.g. "top=5 metric=bytes"
+
+    std::string encode() const {
+        return path + "\n" + std::to_string(begin) + " " + std::to_string(end) + "\n" + args;
+    }
+
+    bool decode(std::string_view msg) {
+        size_t nl1 = msg.find('\n');
+        if (nl1 == std::string_view::npos) return false;
+        size_t nl2 = msg.find('\n', nl1 + 1);
+        if (nl2 == std::string_view::npos) return false;
+        path.assign(msg.substr(0, nl1));
+        std::string range(msg.substr(nl1 + 1, nl2 - nl1 - 1));
+        unsigned long long b, e;
+        if (sscanf(range.c_str(), "%llu %llu", &b, &e) != 2 || b > e) return false;
+        begin = b;
+        end = e;
+        args.assign(msg.substr(nl2 + 1));
+        return true;
+    }
+};
+
+// Looks up "key=value" in a space-separated argument string.
+inline std::string arg_value(std::string_view args, std::string_view key, std::string_view fallback = "") {
+    size_t pos = 0;
+    while (pos < args.size()) {
+        size_t end = args.find(' ', pos);
+        if (end == std::string_view::npos) end = args.size();
+        std::string_view item = args.substr(pos, end - pos);
+        if (item.size() > key.size() && item.compare(0, key.size(), key) == 0 && item[key.size()] == '=') {
+            return std::string(item.substr(key.size() + 1));
+        }
+        pos = end + 1;
+    }
+    return std::string(fallback);
+}
+
+// Resolves `path` (symlinks and ".." included) and accepts it only if it lies inside
+// `root`, which must already be a realpath.
+inline bool confine_path(const std::string& root, const std::string& path, std::string& resolved) {
+    char buf[PATH_MAX];
+    if (!realpath(path.c_str(), buf)) return false;
+    resolved = buf;
+    if (root == "/") return true;
+    return resolved.size() > root.size() && resolved.compare(0, root.size(), root) == 0 &&
+           resolved[root.size()] == '/';
+}
+
+// Worker side: accepts coordinators forever, one thread per connection, and answers
+// every request with handle(const RangeRequest&) -> reply. Requests for paths outside
+// `root` are refused before handle sees them. Returns only on setup errors.
+template <class Handle>
+int serve(const std::string& addr, const std::string& root, Handle handle) {
+    char root_buf[PATH_MAX];
+    if (!realpath(root.c_str(), root_buf)) {
+        perror(root.c_str());
+        return 1;
+    }
+    std::string real_root = root_buf;
+    int listener = listen_on(addr);
+    if (listener == -1) {
+        perror(("listen " + addr).c_str());
+        return 1;
+    }
+    while (true) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return 1;
+        }
+        set_nodelay(fd);    // fails harmlessly on UNIX sockets
+        // handle is copied into every thread: detached threads must not refer to this frame
+        std::thread([fd, real_root, handle] {
+            std::string msg, resolved;
+            RangeRequest request;
+            while (recv_message(fd, msg)) {
+                std::string reply;
+                if (!request.decode(msg)) {
+                    reply = "ERROR malformed request";
+                } else if (!confine_path(real_root, request.path, resolved)) {
+                    reply = "ERROR cannot open " + request.path + " under the worker root";
+                } else {
+                    request.path = resolved;
+                    reply = handle(request);
+                }
+                if (!send_message(fd, reply)) break;
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+// Splits "a,b,c" into its items.
+inline std::vector<std::string> split_list(std::string_view list) {
+    std::vector<std::string> items;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string_view::npos) end = list.size();
+        if (end > pos) items.emplace_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return items;
+}
+
+} // namespace mapreduce
+
+#endif
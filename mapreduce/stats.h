@@ -0,0 +1,189 @@
+// Phase / per-thread timing and throughput report shared by the MapReduce drivers.
+// Allocation counts come from the operator new replacement in alloc_count.h, which a
+// program opts into separately.
+#ifndef MAPREDUCE_STATS_H
+#define MAPREDUCE_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+namespace mapreduce {
+
+// Fed by alloc_count.h while allocation_counting is on; a driver turns it on when stats
+// are requested, so other runs pay no atomic increment per allocation.
+inline std::atomic<bool> allocation_counting{false};
+inline std::atomic<uint64_t> allocation_count{0};
+inline std::atomic<uint64_t> allocated_bytes{0};
+
+inline double now_seconds() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// What one worker thread did during the map phase.
+struct ThreadStats {
+    double busy_seconds = 0;
+    uint64_t splits = 0;
+    uint64_t bytes = 0;
+    uint64_t items = 0;
+};
+
+class JobStats {
+public:
+    // item_name is what the job counts per split: "words", "lines", ...
+    JobStats(std::string tool, std::string item_name, size_t num_threads)
+        : tool(std::move(tool)), item_name(std::move(item_name)), threads(num_threads),
+          largest_split(num_threads), start(now_seconds()), allocations_at_start(allocation_count.load()),
+          bytes_at_start(allocated_bytes.load()) {}
+
+    // Ends the phase in progress (if any) and starts timing the next one.
+    void phase(const char* name) {
+        finish();
+        current = name;
+        phase_start = now_seconds();
+    }
+
+    void finish() {
+        if (current) phases.push_back({current, now_seconds() - phase_start});
+        current = nullptr;
+    }
+
+    // Called by worker `worker` after each split; each worker only touches its own slot.
+    void record_split(size_t worker, double seconds, uint64_t bytes, uint64_t items) {
+        ThreadStats& t = threads[worker];
+        t.busy_seconds += seconds;
+        t.splits++;
+        t.bytes += bytes;
+        t.items += items;
+        largest_split[worker] = std::max(largest_split[worker], bytes);
+    }
+
+    void set_input_bytes(uint64_t bytes) { input_bytes = bytes; }
+
+    // Both reports include the phase still in progress only once finish() has been called.
+    void print(std::ostream& out) const {
+        Summary s = summarize();
+        char line[256];
+        out << "[Stats] Phases:";
+        for (const auto& p : phases) {
+            snprintf(line, sizeof(line), " %s %.3fs", p.name, p.seconds);
+            out << line;
+        }
+        snprintf(line, sizeof(line), " | total %.3fs\n", s.total_seconds);
+        out << line;
+        snprintf(line, sizeof(line),
+                 "[Stats] %.1f MB/s, %.0f %s/s over %llu bytes and %llu %s\n",
+                 s.bytes_per_second / 1e6, s.items_per_second, item_name.c_str(),
+                 (unsigned long long)input_bytes, (unsigned long long)s.items, item_name.c_str());
+        out << line;
+        snprintf(line, sizeof(line),
+                 "[Stats] %llu splits, split size skew %.2f, thread busy skew %.2f (max/mean)\n",
+                 (unsigned long long)s.splits, s.split_skew, s.thread_skew);
+        out << line;
+        for (size_t w = 0; w < threads.size(); ++w) {
+            const ThreadStats& t = threads[w];
+            snprintf(line, sizeof(line), "[Stats]   thread %zu: %.3fs busy, %llu splits, %llu bytes, %llu %s\n",
+                     w, t.busy_seconds, (unsigned long long)t.splits, (unsigned long long)t.bytes,
+                     (unsigned long long)t.items, item_name.c_str());
+            out << line;
+        }
+        if (allocation_counting.load(std::memory_order_relaxed)) {
+            snprintf(line, sizeof(line), "[Stats] Peak RSS %ld KB, %llu allocations (%llu bytes)\n",
+                     peak_rss_kb(), (unsigned long long)s.allocations, (unsigned long long)s.allocated);
+        } else {
+            snprintf(line, sizeof(line), "[Stats] Peak RSS %ld KB\n", peak_rss_kb());
+        }
+        out << line;
+    }
+
+    bool write_json(const std::string& path) const {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) return false;
+        Summary s = summarize();
+        fprintf(f, "{\n  \"tool\": \"%s\",\n  \"threads\": %zu,\n", tool.c_str(), threads.size());
+        fprintf(f, "  \"input_bytes\": %llu,\n  \"items\": %llu,\n  \"item_name\": \"%s\",\n",
+                (unsigned long long)input_bytes, (unsigned long long)s.items, item_name.c_str());
+        fprintf(f, "  \"total_seconds\": %.6f,\n  \"phases\": [", s.total_seconds);
+        for (size_t i = 0; i < phases.size(); ++i) {
+            fprintf(f, "%s\n    {\"name\": \"%s\", \"seconds\": %.6f}", i ? "," : "",
+                    phases[i].name, phases[i].seconds);
+        }
+        fprintf(f, "\n  ],\n  \"bytes_per_second\": %.1f,\n  \"items_per_second\": %.1f,\n",
+                s.bytes_per_second, s.items_per_second);
+        fprintf(f, "  \"splits\": %llu,\n  \"split_skew\": %.4f,\n  \"thread_skew\": %.4f,\n",
+                (unsigned long long)s.splits, s.split_skew, s.thread_skew);
+        fprintf(f, "  \"per_thread\": [");
+        for (size_t w = 0; w < threads.size(); ++w) {
+            const ThreadStats& t = threads[w];
+            fprintf(f, "%s\n    {\"id\": %zu, \"busy_seconds\": %.6f, \"splits\": %llu, "
+                       "\"bytes\": %llu, \"items\": %llu}",
+                    w ? "," : "", w, t.busy_seconds, (unsigned long long)t.splits,
+                    (unsigned long long)t.bytes, (unsigned long long)t.items);
+        }
+        fprintf(f, "\n  ],\n  \"peak_rss_kb\": %ld,\n  \"allocations\": %llu,\n  \"allocated_bytes\": %llu\n}\n",
+                peak_rss_kb(), (unsigned long long)s.allocations, (unsigned long long)s.allocated);
+        return fclose(f) == 0;
+    }
+
+private:
+    struct PhaseTime {
+        const char* name;
+        double seconds;
+    };
+
+    struct Summary {
+        double total_seconds, bytes_per_second, items_per_second, split_skew, thread_skew;
+        uint64_t items, splits, allocations, allocated;
+    };
+
+    Summary summarize() const {
+        Summary s{};
+        s.total_seconds = now_seconds() - start;
+        double busy_max = 0, busy_sum = 0;
+        uint64_t split_max = 0;
+        for (size_t w = 0; w < threads.size(); ++w) {
+            s.items += threads[w].items;
+            s.splits += threads[w].splits;
+            busy_sum += threads[w].busy_seconds;
+            busy_max = std::max(busy_max, threads[w].busy_seconds);
+            split_max = std::max(split_max, largest_split[w]);
+        }
+        double map_bytes = 0;
+        for (const auto& t : threads) map_bytes += t.bytes;
+        s.split_skew = s.splits && map_bytes ? split_max / (map_bytes / s.splits) : 0;
+        s.thread_skew = busy_sum > 0 ? busy_max / (busy_sum / threads.size()) : 0;
+        s.bytes_per_second = s.total_seconds > 0 ? input_bytes / s.total_seconds : 0;
+        s.items_per_second = s.total_seconds > 0 ? s.items / s.total_seconds : 0;
+        s.allocations = allocation_count.load() - allocations_at_start;
+        s.allocated = allocated_bytes.load() - bytes_at_start;
+        return s;
+    }
+
+    std::string tool, item_name;
+    std::vector<ThreadStats> threads;
+    std::vector<uint64_t> largest_split;
+    std::vector<PhaseTime> phases;
+    const char* current = nullptr;
+    uint64_t input_bytes = 0;
+    double start, phase_start = 0;
+    uint64_t allocations_at_start, bytes_at_start;
+};
+
+} // namespace mapreduce
+
+#endif